@@ -278,7 +278,7 @@ void startSocketCheckThread(void) {
 void *socketCheck(void * arg) {
   int i, bytesAvailable;
   sleep(10);
-  for (i = 0; i < NUM_CLIENTS; i++) {
+  for (i = 0; i < NUM_CLIENTS && sockets[i] != 0; i++) {
     if (ioctl(sockets[i], FIONREAD, &bytesAvailable) < 0) {
       perror("ioctl");
       exit(-1);
@@ -327,12 +327,14 @@ void acceptLoop(int numWorkers)
       printf("Error %d doing accept", errno);
       exit(-1);
     }
-    sockets[current_client] = sock_tmp;
+    // only the first NUM_CLIENTS sockets are remembered for socketCheck.
+    if (current_client < NUM_CLIENTS) {
+      sockets[current_client++] = sock_tmp;
+    }
     setNonBlocking(sock_tmp);
     event.data.fd = sock_tmp;
     event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
     epoll_ctl(workers[current_worker].efd, EPOLL_CTL_ADD, sock_tmp, &event);
-    current_client++;
     current_worker = (current_worker + 1) % numWorkers;
   }
 }
@@ -0,0 +1,183 @@
+/*
+Linux stand-in for <sys/event.h>, so that the kqueueserver programs build
+and run unchanged on Linux. Compile them with -Icompat (the Makefile does
+this automatically on Linux).
+
+Each kqueue is an epoll instance and each kevent change becomes an
+epoll_ctl, so concurrent kevent() calls on one queue behave the way
+concurrent epoll_ctl/epoll_wait calls do. Only the subset the servers use
+is implemented:
+
+  - filters EVFILT_READ and EVFILT_WRITE, one filter per descriptor per
+    queue (adding the other filter replaces the first);
+  - flags EV_ADD, EV_DELETE, EV_ONESHOT (EPOLLONESHOT), EV_CLEAR (EPOLLET)
+    and EV_ENABLE/EV_DISABLE;
+  - returned events carry ident, the filter that was registered (kept
+    next to the descriptor in the epoll data, so an EPOLLERR-only wakeup
+    comes back as what it was armed for) and EV_EOF. data, fflags and
+    udata are always 0, and errors are reported by returning -1 rather
+    than as EV_ERROR events.
+ */
+
+#ifndef COMPAT_SYS_EVENT_H
+#define COMPAT_SYS_EVENT_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define EVFILT_READ     (-1)
+#define EVFILT_WRITE    (-2)
+
+#define EV_ADD          0x0001
+#define EV_DELETE       0x0002
+#define EV_ENABLE       0x0004
+#define EV_DISABLE      0x0008
+#define EV_ONESHOT      0x0010
+#define EV_CLEAR        0x0020
+#define EV_ERROR        0x4000
+#define EV_EOF          0x8000
+
+struct kevent {
+  uintptr_t ident;
+  int16_t   filter;
+  uint16_t  flags;
+  uint32_t  fflags;
+  intptr_t  data;
+  void      *udata;
+};
+
+struct kevent64_s {
+  uint64_t  ident;
+  int16_t   filter;
+  uint16_t  flags;
+  uint32_t  fflags;
+  int64_t   data;
+  uint64_t  udata;
+  uint64_t  ext[2];
+};
+
+#define EV_SET(kevp, a, b, c, d, e, f) do {	\
+    struct kevent *__kevp = (kevp);		\
+    __kevp->ident = (a);			\
+    __kevp->filter = (b);			\
+    __kevp->flags = (c);			\
+    __kevp->fflags = (d);			\
+    __kevp->data = (e);				\
+    __kevp->udata = (f);			\
+  } while (0)
+
+#define EV_SET64(kevp, a, b, c, d, e, f, g, h) do {	\
+    struct kevent64_s *__kevp = (kevp);			\
+    __kevp->ident = (a);				\
+    __kevp->filter = (b);				\
+    __kevp->flags = (c);				\
+    __kevp->fflags = (d);				\
+    __kevp->data = (e);					\
+    __kevp->udata = (f);				\
+    __kevp->ext[0] = (g);				\
+    __kevp->ext[1] = (h);				\
+  } while (0)
+
+static inline int kqueue(void) {
+  return epoll_create1(EPOLL_CLOEXEC);
+}
+
+// What each epoll registration carries: the descriptor, and the filter
+// it was added for in the upper half.
+#define __KQUEUE_DATA(fd, filter) ((uint32_t) (fd) | (uint64_t) (uint16_t) (filter) << 32)
+#define __KQUEUE_IDENT(data) ((uint32_t) (data))
+#define __KQUEUE_FILTER(data) ((int16_t) ((data) >> 32))
+
+// Apply one change to the epoll set behind kq.
+static inline int __kqueue_change(int kq, int fd, int16_t filter, uint16_t flags) {
+  struct epoll_event event;
+
+  if (flags & EV_DELETE) {
+    return epoll_ctl(kq, EPOLL_CTL_DEL, fd, NULL);
+  }
+  if (filter != EVFILT_READ && filter != EVFILT_WRITE) {
+    errno = EINVAL;
+    return -1;
+  }
+  event.data.u64 = __KQUEUE_DATA(fd, filter);
+  // EPOLLRDHUP only for reads: a writer blocked on a half-closed socket
+  // would otherwise be woken over and over for nothing to write.
+  event.events = filter == EVFILT_READ ? EPOLLIN | EPOLLRDHUP : EPOLLOUT;
+  if (flags & EV_ONESHOT) event.events |= EPOLLONESHOT;
+  if (flags & EV_CLEAR) event.events |= EPOLLET;
+  if (flags & EV_DISABLE) event.events = 0;
+  if (!(flags & (EV_ADD | EV_ENABLE | EV_DISABLE))) return 0;
+
+  // EV_ADD both adds and modifies, and re-enables a fired EV_ONESHOT.
+  if (epoll_ctl(kq, EPOLL_CTL_MOD, fd, &event) == 0) return 0;
+  if (errno != ENOENT || !(flags & EV_ADD)) return -1;
+  return epoll_ctl(kq, EPOLL_CTL_ADD, fd, &event);
+}
+
+static inline int __kqueue_timeout(const struct timespec *timeout) {
+  if (timeout == NULL) return -1;
+  return timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+}
+
+#define __KQUEUE_MAX_BATCH 512
+
+static inline int kevent(int kq, const struct kevent *changelist, int nchanges,
+			 struct kevent *eventlist, int nevents,
+			 const struct timespec *timeout) {
+  struct epoll_event events[__KQUEUE_MAX_BATCH];
+  int i, n;
+
+  for (i = 0; i < nchanges; i++) {
+    if (__kqueue_change(kq, changelist[i].ident, changelist[i].filter, changelist[i].flags)) {
+      return -1;
+    }
+  }
+  if (nevents <= 0) return 0;
+  if (nevents > __KQUEUE_MAX_BATCH) nevents = __KQUEUE_MAX_BATCH;
+  do {
+    n = epoll_wait(kq, events, nevents, __kqueue_timeout(timeout));
+  } while (n == -1 && errno == EINTR);
+  for (i = 0; i < n; i++) {
+    eventlist[i].ident = __KQUEUE_IDENT(events[i].data.u64);
+    eventlist[i].filter = __KQUEUE_FILTER(events[i].data.u64);
+    eventlist[i].flags = (events[i].events & (EPOLLRDHUP | EPOLLHUP)) ? EV_EOF : 0;
+    eventlist[i].fflags = 0;
+    eventlist[i].data = 0;
+    eventlist[i].udata = NULL;
+  }
+  return n;
+}
+
+static inline int kevent64(int kq, const struct kevent64_s *changelist, int nchanges,
+			   struct kevent64_s *eventlist, int nevents,
+			   unsigned int flags, const struct timespec *timeout) {
+  struct epoll_event events[__KQUEUE_MAX_BATCH];
+  int i, n;
+
+  (void) flags;
+  for (i = 0; i < nchanges; i++) {
+    if (__kqueue_change(kq, changelist[i].ident, changelist[i].filter, changelist[i].flags)) {
+      return -1;
+    }
+  }
+  if (nevents <= 0) return 0;
+  if (nevents > __KQUEUE_MAX_BATCH) nevents = __KQUEUE_MAX_BATCH;
+  do {
+    n = epoll_wait(kq, events, nevents, __kqueue_timeout(timeout));
+  } while (n == -1 && errno == EINTR);
+  for (i = 0; i < n; i++) {
+    eventlist[i].ident = __KQUEUE_IDENT(events[i].data.u64);
+    eventlist[i].filter = __KQUEUE_FILTER(events[i].data.u64);
+    eventlist[i].flags = (events[i].events & (EPOLLRDHUP | EPOLLHUP)) ? EV_EOF : 0;
+    eventlist[i].fflags = 0;
+    eventlist[i].data = 0;
+    eventlist[i].udata = 0;
+    eventlist[i].ext[0] = eventlist[i].ext[1] = 0;
+  }
+  return n;
+}
+
+#endif
@@ -1,6 +1,8 @@
 // compile with
 // gcc -O2 epollbug.c -lpthread -Wall
+// (add -Icompat to get the kqueue backends on Linux, see compat/sys/event.h)
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -16,30 +18,514 @@
 #include <sys/eventfd.h>
 #include <stdint.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <linux/mempolicy.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <linux/errqueue.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/event.h>)
+#include <sys/event.h>
+#define HAVE_KQUEUE
+#endif
+#endif
 
 // data types
 struct worker_info {
-  int efd; // epoll instance
+  int efd; // epoll or kqueue instance, shared by all workers in shared modes
+  int lsd; // listen socket this worker accepts from, or -1
+  struct msg_queue *inbox; // NULL where workers share an event set
+};
+
+// A message for a worker, see sendMessage.
+struct worker_msg {
+  int type;            // MSG_*
+  int fd;
+  uint32_t arms;       // MSG_REARM: the socket's arms when the watchdog looked
+};
+
+struct msg_slot {
+  uint64_t seq;
+  struct worker_msg msg;
+};
+
+// What the watchdog last saw of the connection on an fd; its own, so it
+// never writes to a connection that may be closing under it.
+struct watch_slot {
+  uint64_t serial;     // the connection's, or 0
+  uint64_t since;      // ms; 0 while the socket looks healthy
+  uint32_t arms;
+};
+
+// A bounded lock-free queue with many producers and the owning worker
+// as its only consumer, plus the eventfd (in the worker's event set)
+// that wakes the worker for it.
+struct msg_queue {
+  uint64_t head;       // consumer only; dispatchTwoChoices reads it
+  uint64_t received;   // messages taken
+  uint64_t wakeups;    // eventfd reads that took them
+  int efd;
+  struct msg_slot *slots;
+  uint64_t tail __attribute__((aligned(64)));       // producers claim slots here
+  int wakeupPending __attribute__((aligned(64)));   // an eventfd write is outstanding
+};
+
+// A raw io_uring instance plus the provided-buffer ring that multishot
+// recv picks its buffers from. We talk to the kernel directly so that
+// the program keeps compiling with nothing but -lpthread.
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail; // sqes filled in but not yet published
+  unsigned to_submit;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  unsigned br_tail;
+};
+
+// Incremental request framing state, see httpNextRequest.
+struct http_parser {
+  char *partial;       // pooled copy of a header split across reads
+  int headerLen;       // header bytes seen so far for the current request
+  long bodyRemaining;  // body bytes of the last request still to skip
+  char method;         // first byte of the request line
+};
+
+struct http_request {
+  char *start;         // header block, if it lies within one read
+  int headerLen;
+};
+
+// Per-connection state, kept in the fd-indexed connection table and
+// padded to a cache line so neighbouring fds served by different
+// workers do not false-share.
+struct conn {
+  int owner;           // worker serving this connection
+  uint64_t requests;   // requests served on this connection
+  struct http_parser parser;
+  // Output the socket did not take yet: the unsent tail of a response
+  // cut short by a partial write (copied, since the template it came from
+  // gets a new Date), then outCount whole responses. While this is
+  // non-empty the socket is armed for EPOLLOUT only, so reading pauses.
+  char *outPartial;
+  int outPartialOff;
+  int outPartialLen;
+  int outCount;
+  struct file_queue *files; // -D: responses owed instead, see flushFiles
+  struct zerocopy_pins *pins; // -Z: responses the kernel may still send from
+  uint32_t zeroCopyId;        // -Z: how the kernel numbers the next such send
+  // Lost-wakeup watchdog: arms counts the times the socket was put back
+  // to wait for input and armed says it is waiting now; the worker
+  // writes both. serial is unique while the connection is open and 0
+  // once it closes, so the watchdog can tell whether what it read was
+  // all the same connection's, see watchdogLoop.
+  uint32_t arms;
+  char armed;
+  uint64_t serial;
+  // -T: while a connection waits it is on its owner's timer wheel,
+  // filed under timerTick, which may be earlier than its deadline but
+  // never later, see setTimeout.
+  struct conn *timerNext;
+  struct conn **timerPrev; // NULL while not on a wheel
+  uint64_t timerTick;
+  uint64_t deadline;       // ms
+  uint64_t timerRequests;  // requests served when the deadline was set
+  int fd;
+  char timerKind;          // TIMEOUT_IDLE, _REQUEST or _WRITE
+  char closing;    // no more requests will be read; close once sends drain
+  uint64_t waitAt; // -L: when the oldest unsent responses' requests arrived,
+  uint64_t recvAt; // while those wait for the socket; recvAt is 0 otherwise
+  // io_uring backend only
+  int pending;     // responses owed but not yet submitted
+  char inflight;   // a chain of linked sends is outstanding
+} __attribute__((aligned(64)));
+
+// A fully rendered response, double-buffered so the Date line can be
+// refreshed without workers ever formatting it, see buildTemplate.
+struct response_template {
+  char *buf[2];
+  size_t len;
+  size_t dateOffset;
+  struct iovec *iov[2]; // MAX_IOVECS entries, all pointing at buf[b]
+  int current;  // which buf workers use
+  size_t headerLen;  // what a HEAD request gets
+};
+
+// A file under the -D document root with its open fd and rendered
+// header block, cached by the worker that opened it, see lookupFile.
+// Responses queued on connections hold references, so an entry that
+// leaves the cache lives on until they have gone out.
+#define FILE_HEADER_MAX 256
+struct file_entry {
+  struct file_entry *hashNext;
+  struct file_entry *newer, *older; // LRU list, owner only
+  int refs;             // the cache's, plus one per queued response
+  int fd;
+  off_t size;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  time_t checkedAt;     // dateNow when last matched against the path
+  time_t stampedAt;     // dateNow when the Date in header was written
+  int headerLen;
+  char header[FILE_HEADER_MAX];
+  uint32_t hash;
+  char uncacheable;     // -C: reached through a symlink, or too big
+  uint64_t refusedAt;   // -C: cacheRoom when the cache had no room for it
+  int pathLen;
+  char path[];          // relative to the document root
+};
+
+// -C: a complete response for a small file, shared by all workers.
+// Both copies of t (a Date apart, as in a template) and nothing else
+// live in one anonymous mapping. Readers find it in cacheBuckets
+// without locking; it is freed once retired, every worker has been
+// through a wait since, and no queued response still counts it, see
+// reclaimResponses. When the cache is full, the clock (cacheHand) goes
+// round its entries, evicting those not hit since it last came by.
+struct cached_response {
+  struct response_template t;
+  struct cached_response *next;    // hash chain
+  struct cached_response *retired; // the retired list, cacheLock
+  struct cached_response *clockNext, *clockPrev; // the clock, cacheLock
+  char referenced;   // hit since the clock hand last came by
+  uint64_t retiredEpoch;
+  size_t mapLen;
+  int refs;          // queued responses that outlived their batch
+  uint32_t hash;
+  int pathLen;
+  char path[];
+};
+
+// Where worker w was when it last woke up, for reclaimResponses: the
+// cacheEpoch it saw, or 0 while it waits and holds no uncounted
+// cached response.
+struct cache_reader {
+  uint64_t epoch;
+} __attribute__((aligned(64)));
+
+// Per-worker LRU of file entries, hashed by path.
+#define FILE_CACHE_SIZE 512
+#define FILE_CACHE_BUCKETS 1024 // a power of 2
+struct file_cache {
+  struct file_entry *buckets[FILE_CACHE_BUCKETS];
+  struct file_entry *newest, *oldest;
+  int count;
+};
+
+// A response owed on a -D connection: count copies of either a file's
+// header and body or a template, len bytes each, pos of the first one
+// sent.
+struct file_send {
+  struct file_entry *file;
+  struct response_template *t;  // when file is NULL
+  struct cached_response *cached; // t's, if it is one
+  off_t len;
+  off_t pos;
+  int count;
+  char counted;                 // holds a reference on cached
+};
+
+// The responses owed on a connection, oldest first, in a pooled buffer
+// (FILE_QUEUE_LEN items) that is freed once they have all gone out.
+struct file_queue {
+  int head;
+  int count;
+  struct file_send items[];
+};
+
+// The cached responses a connection sent with MSG_ZEROCOPY whose
+// completions are still to come, in the order the kernel numbered the
+// sends: pinned[head] went out as zeroCopyId - count. A slot is NULL if
+// its completion came back before an earlier one's. Pooled like
+// file_queue and freed once empty, see reapZeroCopy.
+struct zerocopy_pins {
+  int head;
+  int count;
+  struct cached_response *pinned[];
+};
+
+// A pool of fixed-size objects carved from slabs, see poolAlloc.
+struct free_obj;
+struct pool {
+  struct free_obj *freeList;   // owner thread only
+  struct pool_set *owner;
+  size_t objSize;
+  long inUse;                  // remote frees count once reclaimed
+  long capacity;
+  int slabs;
+  struct free_obj *remoteFree __attribute__((aligned(64))); // other threads push here
+};
+
+struct pool_set {
+  int id;              // worker number, -1 for the accept thread
+  struct pool conns;
+  struct pool bufs;
+};
+
+// An event backend: how workers wait for ready sockets and how a socket
+// is handed to a worker and re-armed. Everything above that (parsing,
+// output queueing, the connection table) is shared, see serviceSocket.
+struct backend {
+  const char *name;
+  void (*setup)(int);          // create event sets and listen sockets
+  void *(*workerLoop)(void *);
+  void (*addSocket)(int, int); // register a new connection with a worker
+  void (*armSocket)(int, int, int); // re-arm for ARM_READ or ARM_WRITE
+  int acceptThread;            // main thread accepts and deals out connections
+  void (*dropSocket)(int, int); // take a drained socket out of a worker's set,
+                                // NULL if connections cannot move
+  int sharedSet;               // any worker may get any connection's events
+};
+
+// How acceptLoop picks the worker for a new connection.
+struct dispatch_policy {
+  const char *name;
+  int (*pick)(int, int); // (incoming cpu or -1, numWorkers) -> worker
+};
+
+// Per-worker locality counters, see countLocality, one cache line per
+// worker.
+struct dispatch_stats {
+  uint64_t cpuHits;    // connections whose packets arrive on the worker's cpu
+  uint64_t cpuMisses;  // ... and on some other cpu
+} __attribute__((aligned(64)));
+
+// Per-worker load, read by the load-aware dispatch policies. Each field
+// has one writer except active, which the accepting thread increments.
+struct worker_load {
+  long active;         // connections owned by the worker
+  uint64_t requests;   // requests served
+  uint64_t lastRequests;
+  uint64_t rate;       // requests served in the last second, see sampleLoad
+  int queueDepth;      // ready sockets returned by the worker's last wait
+  int stealRequested;  // set by the idle worker, cleared by its donor
+  uint64_t migratedIn; // connections handed to this worker, see migrateConnection
+  time_t migrateSecond; // rate limit window of connections handed away
+  int migrateCount;
+} __attribute__((aligned(64)));
+
+// Per-worker event counters, written only by the worker they belong to
+// (see STAT_ADD) and summed only when a report is asked for.
+struct worker_stats {
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+  uint64_t waits;      // epoll_wait, kevent or io_uring_enter returns
+  uint64_t events;     // ready sockets or completions those returned
+  uint64_t eagains;    // recv or writev found the socket drained or full
+  uint64_t rearms;
+  uint64_t closes;     // connections this worker closed, for any reason
+  uint64_t resets;     // of those, closed on a recv or send error such as ECONNRESET
+  uint64_t timeouts[3]; // -T expiries, by kind
+  uint64_t fileHits;   // -D requests served from the worker's file cache
+  uint64_t fileMisses; // ... and those that had to open the file
+  uint64_t cacheHits;  // -C requests answered from the response cache
+  uint64_t cacheMisses;
+  uint64_t zeroCopySends;  // -Z: bodies sent with MSG_ZEROCOPY
+  uint64_t zeroCopyCopied; // ... that the kernel copied after all, as on loopback
+  uint64_t zeroCopyFallbacks; // ... and sent by copy: no pin left, or ENOBUFS
+} __attribute__((aligned(64)));
+
+// Log-linear latency histogram in nanoseconds, bucketed like loadgen's
+// (HIST_SUB_BUCKETS linear buckets per power of two). Only its worker
+// writes it; readers merge with relaxed loads, see histMerge.
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t max;
+};
+
+struct worker_latency {
+  struct histogram waitToSend;  // wait returned .. responses fully sent
+  struct histogram recvToSend;  // requests read .. responses fully sent
+};
+
+// Per-worker hashed timer wheel (-T): slot i holds the connections
+// filed under ticks congruent to i, each a doubly linked list through
+// conn.timerNext/timerPrev. Only its worker touches it.
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS 1024     // a power of 2; one turn is 102.4 s
+struct timer_wheel {
+  struct conn *slots[TIMER_SLOTS];
+  uint64_t tick;   // next tick to expire
+  uint64_t now;    // ms, when the last wait returned
+  int count;       // connections on the wheel
 };
 
 // prototypes
 void startWakeupThread(void);
 void *wakeupThreadLoop(void *);
-void acceptLoop(int);
+void acceptLoop(int, int);
+int createListenSocket(int);
+void acceptConnections(int, int);
 void startWorkers(int);
 void startWorkerThread(int);
-void *workerLoop(void *);
-void startSocketCheckThread(void);
+void serviceSocket(int, int, int, char []);
+void startWatchdog(void);
+void *watchdogLoop(void *);
+void registerSocket(int, int);
 void receiveLoop(int, int, char []);
+void epollSetup(int);
+void epollReuseportSetup(int);
+void epollSharedSetup(int);
+void epollAddListener(int, int, uint32_t);
+void epollRearmListener(int, int);
+void *epollWorkerLoop(void *);
+void epollAddSocket(int, int);
+void epollArmSocket(int, int, int);
+#ifdef HAVE_KQUEUE
+void kqueueSetup(int);
+void kqueueSharedSetup(int);
+void *kqueueWorkerLoop(void *);
+void kqueueAddSocket(int, int);
+void kqueueArmSocket(int, int, int);
+#endif
 void setNonBlocking(int);
-void *socketCheck(void *);
+int flushOutput(int, int);
+int flushFiles(int, int);
+void armSocket(int, int, int);
+void printWorkerStats(FILE *);
+void histRecord(struct histogram *, uint64_t);
+void histMerge(struct histogram *, struct histogram *);
+uint64_t histPercentile(struct histogram *, double);
+void recordLatency(uint64_t, uint64_t);
+void printLatencyStats(FILE *);
+void printReport(FILE *);
+void startStatsServer(const char *);
+void *statsServerLoop(void *);
+void initConnectionTable(void);
+void shedConnection(int, int);
+void printProcessStats(FILE *);
+struct conn *newConnection(int, int);
+void closeConnection(int);
+void initThreadPools(int);
+void *poolAlloc(struct pool *);
+void poolFree(void *);
+void *bufAlloc(void);
+void printPoolStats(FILE *);
+void *statsLoop(void *);
+void buildTemplate(struct response_template *, const char *, const char *, const char *);
+void refreshDate(void);
+void *dateLoop(void *);
+void startDateThread(void);
+int queueFile(struct conn *, int, struct http_request *);
+struct file_entry *lookupFile(int, char *, int *, struct response_template **);
+void releaseFile(struct file_entry *);
+void freeFileQueue(struct file_queue *);
+void printFileStats(FILE *);
+struct cached_response *lookupResponse(char *, int);
+struct cached_response *cacheResponse(struct file_entry *, char *, int);
+void releaseResponse(struct cached_response *);
+void stampResponses(time_t);
+void startCacheThread(void);
+void *cacheLoop(void *);
+void invalidateResponses(char *, int);
+void reclaimResponses(void);
+void printCacheStats(FILE *);
+ssize_t sendZeroCopy(int, int, struct file_send *, int);
+void reapZeroCopy(int, int);
+void freeZeroCopyPins(struct zerocopy_pins *);
+void printZeroCopyStats(FILE *);
+int httpNextRequest(struct http_parser *, char *, int, int *, struct http_request *);
+void uringSetupWorkers(int);
+void *uringWorkerLoop(void *);
+int planWorkerCpus(int, const char *);
+void *workerStart(void *);
+int dispatchRoundRobin(int, int);
+int dispatchIncomingCpu(int, int);
+int dispatchLeastConnections(int, int);
+int dispatchTwoChoices(int, int);
+void sampleLoad(void);
+void requestSteal(int);
+int migrateConnection(int, int);
+void epollDropSocket(int, int);
+#ifdef HAVE_KQUEUE
+void kqueueDropSocket(int, int);
+#endif
+void initInbox(int);
+int sendMessage(int, int, int, uint32_t);
+void handOff(int, int, int);
+void drainInbox(int);
+void armTimeout(struct conn *, int);
+void cancelTimeout(struct conn *);
+int nextTimeout(void);
+void expireTimeouts(int);
+void printTimeoutStats(FILE *);
+void printLoadStats(FILE *);
+int incomingCpu(int);
+void countLocality(int, int);
+void printDispatchStats(FILE *);
 
 // constants
 #define MAX_NUM_WORKERS 120
 #define PORT_NUM (8080)
 #define BACKLOG 600
 #define MAX_EVENTS 500
-#define NUM_CLIENTS 1000
+#define NUM_CLIENTS 1000 // connections used by "make bench"
+#define SLAB_SIZE (2 << 20) // one huge page
+#define BUF_SIZE 8192 // pooled buffer size
+#define RECV_BUF_SIZE BUF_SIZE
+#define MAX_HEADER_LEN BUF_SIZE
+#define MAX_IOVECS 64 // responses coalesced into one writev
+#define MAX_TEMPLATES 16
+#define DATE_LEN 29 // "Tue, 09 Oct 2012 16:36:18 GMT"
+#define FILE_PATH_MAX 1024 // -D request paths, decoded
+#define FILE_DATE_OFFSET 23 // strlen("HTTP/1.1 200 OK\r\nDate: ")
+#define FILE_QUEUE_LEN ((int) ((BUF_SIZE - sizeof (struct file_queue)) / sizeof (struct file_send)))
+#define CACHE_BUCKETS 4096   // a power of 2
+#define CACHE_BYTES (64 << 20) // mappings the response cache may hold
+#define CACHE_RECLAIM_MS 100 // how often retired responses are looked at
+#define ZEROCOPY_PINS ((int) ((BUF_SIZE - sizeof (struct zerocopy_pins)) / sizeof (struct cached_response *)))
+#define CONN_CHUNK_BITS 12 // the connection table grows 4096 slots at a time
+#define CONN_CHUNK_SIZE (1 << CONN_CHUNK_BITS)
+#define ARM_READ 1
+#define ARM_WRITE 2
+#define STEAL_IDLE_EVENTS 1  // a wait returning this few sockets asks for work
+#define STEAL_BUSY_EVENTS 16 // a wait returning this many may give work away
+#define MSG_QUEUE_SIZE 4096  // per worker, must be a power of 2
+#define MSG_ACCEPTED 1       // a connection accepted for the worker
+#define MSG_MIGRATED 2       // a connection handed over by another worker
+#define MSG_REARM 3          // the watchdog thinks a wakeup was lost
+
+// How long acceptLoop waits for a connection to refuse when it is out
+// of fds, see shedConnection, and a uring worker or the -U stats thread
+// before it accepts again.
+#define SHED_WAIT_MS 100
+
+// -T timeout kinds, see armTimeout.
+#define TIMEOUT_IDLE 0       // between requests on a keep-alive connection
+#define TIMEOUT_REQUEST 1    // reading a request, or waiting for the first
+#define TIMEOUT_WRITE 2      // the client is not taking its responses
+
+// io_uring backend sizing (per worker).
+#define URING_ENTRIES 1024
+#define URING_NUM_BUFS 1024  // must be a power of 2
+#define URING_BUF_SIZE 2048
+#define URING_BGID 0
+#define MAX_LINKED_SENDS 16
 
 // Define this and the program will print the request made
 // by the http client and then exit.
@@ -56,25 +542,39 @@ void *socketCheck(void *);
   #undef SHOW_REQUEST
 #endif
 
-// Fill this in with the http request that your
-// weighttp client sends to the server. This is the
-// request that I get.
+// This is the request that weighttp sends (and that loadgen.c
+// sends). The server parses real HTTP/1.1 requests, so clients no
+// longer have to match it byte for byte.
 char EXPECTED_HTTP_REQUEST[] =
   "GET / HTTP/1.1\r\nHost: 10.12.0.1:8080\r\n"
   "User-Agent: weighttp/0.3\r\nConnection: keep-alive\r\n\r\n";
 int EXPECTED_RECV_LEN;
 
-char RESPONSE[] =
-  "HTTP/1.1 200 OK\r\n"
-  "Date: Tue, 09 Oct 2012 16:36:18 GMT\r\n"
-  "Content-Length: 151\r\n"
+// The status line, Date and Content-Length are filled in by buildTemplate.
+char RESPONSE_HEADERS[] =
   "Server: Mighttpd/2.8.1\r\n"
   "Last-Modified: Mon, 09 Jul 2012 03:42:33 GMT\r\n"
-  "Content-Type: text/html\r\n\r\n"
+  "Content-Type: text/html\r\n";
+
+char RESPONSE_BODY[] =
   "<html>\n<head>\n<title>Welcome to nginx!</title>\n</head>\n"
   "<body bgcolor=\"white\" text=\"black\">\n"
   "<center><h1>Welcome to nginx!</h1></center>\n</body>\n</html>\n";
-size_t RESPONSE_LEN;
+
+// -D error responses.
+char ERROR_HEADERS[] =
+  "Server: Mighttpd/2.8.1\r\n"
+  "Content-Type: text/html\r\n";
+
+char NOT_ALLOWED_HEADERS[] =
+  "Server: Mighttpd/2.8.1\r\n"
+  "Allow: GET, HEAD\r\n"
+  "Content-Type: text/html\r\n";
+
+struct response_template RESPONSE;
+struct response_template BAD_REQUEST, NOT_FOUND, NOT_ALLOWED, UNAVAILABLE;
+struct response_template *templates[MAX_TEMPLATES];
+int numTemplates;
 
 // global variables
 
@@ -83,44 +583,321 @@ int evfd = -1;
 #endif
 
 struct worker_info workers[MAX_NUM_WORKERS];
-int sockets[NUM_CLIENTS];
+
+// With -P or -Q worker w runs on workerCpu[w] and prefers memory from
+// workerNode[w]; otherwise both are -1.
+int pinWorkers;
+int workerCpu[MAX_NUM_WORKERS];
+int workerNode[MAX_NUM_WORKERS];
+int cpuWorker[CPU_SETSIZE]; // a worker pinned to each cpu, or -1
+
+// -d picks how acceptLoop deals out connections; the first is the default.
+struct dispatch_policy policies[] = {
+  { "rr", dispatchRoundRobin },
+  // the worker pinned to the cpu that took the connection's packets
+  { "cpu", dispatchIncomingCpu },
+  // the worker with the fewest connections
+  { "least", dispatchLeastConnections },
+  // the less busy of two random workers, by requests/sec
+  { "p2c", dispatchTwoChoices },
+};
+struct dispatch_policy *dispatch = &policies[0];
+struct dispatch_stats dispatchStats[MAX_NUM_WORKERS];
+struct worker_load workerLoad[MAX_NUM_WORKERS];
+struct worker_stats workerStats[MAX_NUM_WORKERS];
+int measureLatency; // -L
+struct worker_latency *workerLatency[MAX_NUM_WORKERS];
+__thread struct worker_latency *localLatency;
+__thread uint64_t waitReturnedAt;
+int numWorkersStarted;
+int migrateLimit; // -m: connections a worker may give away per second
+int numStealRequests;
+int watchdogMillis;   // -w: flag sockets armed this long with unread input
+int watchdogRearm;    // -r: and re-arm them
+uint64_t stallsFound[MAX_NUM_WORKERS];   // written by the watchdog only
+struct watch_slot *watchSlots;           // by fd, the watchdog's only
+uint64_t stallsRearmed[MAX_NUM_WORKERS];
+int timeoutMillis[3];  // -T, by kind; all 0 without it
+__thread struct timer_wheel *localWheel;
+__thread struct uring *localRing; // the calling worker's, io_uring only
+int docRootFd = -1;    // -D
+struct file_cache *fileCaches[MAX_NUM_WORKERS];
+__thread struct file_cache *localFiles;
+time_t dateNow;        // the time in the templates' current Date
+char *docRoot;         // -D, as given
+long cacheLimit;       // -C: largest file kept as a complete response
+long zeroCopyMin;      // -Z: smallest cached body sent with MSG_ZEROCOPY
+struct cached_response *cacheBuckets[CACHE_BUCKETS];
+struct cached_response *cacheRetired;
+struct cached_response *cacheHand; // next to look at for eviction, cacheLock
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER; // writers only
+struct cache_reader cacheReaders[MAX_NUM_WORKERS];
+uint64_t cacheEpoch = 1;
+uint64_t cacheGeneration;  // inotify event batches handled
+uint64_t cacheRoom = 1;    // bumped whenever reclaimResponses frees something
+long cacheEntries, cacheBytes, cacheInvalidations, cacheEvictions; // cacheLock
+long cacheRetiredBytes;    // part of cacheBytes not freed yet, cacheLock
+int inotifyFd = -1;
+
+// -b picks one of these; the first is the default.
+struct backend backends[] = {
+  // one epoll set per worker, fed round-robin by acceptLoop
+  { "epoll", epollSetup, epollWorkerLoop, epollAddSocket, epollArmSocket, 1, epollDropSocket },
+  { "reuseport", epollReuseportSetup, epollWorkerLoop, epollAddSocket, epollArmSocket, 0,
+    epollDropSocket },
+  { "shared", epollSharedSetup, epollWorkerLoop, epollAddSocket, epollArmSocket, 0, NULL, 1 },
+#ifdef HAVE_KQUEUE
+  // kqueueserver3: one kqueue per worker, EV_ONESHOT re-arming
+  { "kqueue", kqueueSetup, kqueueWorkerLoop, kqueueAddSocket, kqueueArmSocket, 1, kqueueDropSocket },
+  // kqueueserver4: every worker calls kevent() on the same kqueue
+  { "kqshared", kqueueSharedSetup, kqueueWorkerLoop, kqueueAddSocket, kqueueArmSocket, 1,
+    NULL, 1 },
+#endif
+  { "uring", uringSetupWorkers, uringWorkerLoop, NULL, NULL, 0 },
+};
+struct backend *backend = &backends[0];
+
+// The connection table is a directory of fixed-size chunks of pointers,
+// indexed by fd. Chunks are allocated the first time an fd in their range
+// is accepted and never move, so workers read the table without locking;
+// only allocating a chunk takes connTableLock. The connection objects
+// themselves come from the accepting thread's slab pool.
+struct conn ***connChunks;
+int numConnChunks;
+int maxFds;
+int connHighWater; // one past the highest fd ever accepted
+uint64_t connSerial; // connections ever opened, see conn.serial
+int spareFd = -1;  // given up to refuse a connection when fds run out
+pthread_mutex_t connTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct conn *getConn(int fd) {
+  return connChunks[fd >> CONN_CHUNK_BITS][fd & (CONN_CHUNK_SIZE - 1)];
+}
+
+// Only worker w calls these, so a plain store is enough.
+static inline void countRequests(int w, int n) {
+  __atomic_store_n(&workerLoad[w].requests, workerLoad[w].requests + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t nowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define STAT_ADD(w, field, n) \
+  __atomic_store_n(&workerStats[w].field, workerStats[w].field + (n), __ATOMIC_RELAXED)
+
+// Account for a wait that returned n ready sockets.
+static inline void countWait(int w, int n) {
+  __atomic_store_n(&workerLoad[w].queueDepth, n, __ATOMIC_RELAXED);
+  STAT_ADD(w, waits, 1);
+  STAT_ADD(w, events, n);
+  if (measureLatency) waitReturnedAt = nowNanos();
+  if (localWheel != NULL) localWheel->now = nowNanos() / 1000000;
+}
+
+// -C: worker w is about to wait, and every cached response it still
+// refers to is counted, or it has woken up. See reclaimResponses.
+static inline void cacheOffline(int w) {
+  __atomic_store_n(&cacheReaders[w].epoch, 0, __ATOMIC_RELEASE);
+}
+
+static inline void cacheOnline(int w) {
+  __atomic_store_n(&cacheReaders[w].epoch, __atomic_load_n(&cacheEpoch, __ATOMIC_SEQ_CST),
+		   __ATOMIC_RELAXED);
+  // the store must land before anything this worker reads from the cache
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+__thread struct pool_set *localPools;
+struct pool_set *poolSets[MAX_NUM_WORKERS + 1];
+int numPoolSets;
+int useHugePages;
 
 int main(int argc, char *argv[]) {
+  int opt;
+  int statsInterval = 0;
+  pthread_t thread;
+  unsigned i;
+  int n;
+  char *irqDevice = NULL;
+  char *statsPath = NULL;
+
   EXPECTED_RECV_LEN = strlen(EXPECTED_HTTP_REQUEST);
-  RESPONSE_LEN = strlen(RESPONSE);
+  buildTemplate(&RESPONSE, "200 OK", RESPONSE_HEADERS, RESPONSE_BODY);
+
+  printf("Length of requst: %d;  response: %zu\n", EXPECTED_RECV_LEN, RESPONSE.len);
 
-  printf("Length of requst: %d;  response: %d\n", EXPECTED_RECV_LEN, RESPONSE_LEN);
-  
-  if (argc != 2) {
-    printf( "usage: %s #workers\n", argv[0] );
+  while ((opt = getopt(argc, argv, "b:C:D:d:HLm:PQ:rS:T:U:w:Z:")) != -1) {
+    switch (opt) {
+    case 'L':
+      measureLatency = 1;
+      break;
+    case 'U':
+      statsPath = optarg;
+      break;
+    case 'w':
+      watchdogMillis = atoi(optarg);
+      break;
+    case 'r':
+      watchdogRearm = 1;
+      break;
+    case 'T':
+      // idle[,request[,write]] seconds; the ones left out match idle
+      n = sscanf(optarg, "%d,%d,%d", &timeoutMillis[TIMEOUT_IDLE],
+		 &timeoutMillis[TIMEOUT_REQUEST], &timeoutMillis[TIMEOUT_WRITE]);
+      if (n < 1 || timeoutMillis[TIMEOUT_IDLE] <= 0) goto usage;
+      if (n < 2) timeoutMillis[TIMEOUT_REQUEST] = timeoutMillis[TIMEOUT_IDLE];
+      if (n < 3) timeoutMillis[TIMEOUT_WRITE] = timeoutMillis[TIMEOUT_IDLE];
+      if (timeoutMillis[TIMEOUT_REQUEST] <= 0 || timeoutMillis[TIMEOUT_WRITE] <= 0) goto usage;
+      for (i = 0; i < 3; i++) timeoutMillis[i] *= 1000;
+      break;
+    case 'm':
+      migrateLimit = atoi(optarg);
+      break;
+    case 'D':
+      if (-1 == (docRootFd = open(optarg, O_PATH | O_DIRECTORY | O_CLOEXEC))) {
+	perror(optarg);
+	return -1;
+      }
+      docRoot = optarg;
+      break;
+    case 'C':
+      if ((cacheLimit = atol(optarg)) <= 0) goto usage;
+      if (cacheLimit > CACHE_BYTES / 2) {
+	printf("error: -C can be at most %d\n", CACHE_BYTES / 2);
+	return -1;
+      }
+      break;
+    case 'Z':
+      if ((zeroCopyMin = atol(optarg)) <= 0) goto usage;
+      break;
+    case 'd':
+      for (i = 0; i < sizeof policies / sizeof policies[0]; i++) {
+	if (!strcmp(optarg, policies[i].name)) break;
+      }
+      if (i == sizeof policies / sizeof policies[0]) {
+	printf("error: unknown dispatch policy %s\n", optarg);
+	return -1;
+      }
+      dispatch = &policies[i];
+      break;
+    case 'P':
+      pinWorkers = 1;
+      break;
+    case 'Q':
+      pinWorkers = 1;
+      irqDevice = optarg;
+      break;
+    case 'H':
+      useHugePages = 1;
+      break;
+    case 'S':
+      statsInterval = atoi(optarg);
+      break;
+    case 'b':
+      for (i = 0; i < sizeof backends / sizeof backends[0]; i++) {
+	if (!strcmp(optarg, backends[i].name)) break;
+      }
+      if (i == sizeof backends / sizeof backends[0]) {
+	printf("error: unknown backend %s\n", optarg);
+	return -1;
+      }
+      backend = &backends[i];
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (optind != argc - 1) {
+  usage:
+    printf( "usage: %s [-b backend] [-D docroot [-C bytes [-Z bytes]]] [-d policy] [-H] [-L] [-m migrations/sec] [-P] [-Q netdev]"
+	    " [-S secs] [-T idle[,request[,write]]] [-U path] [-w ms [-r]] #workers\nbackends:", argv[0] );
+    for (i = 0; i < sizeof backends / sizeof backends[0]; i++) {
+      printf(" %s", backends[i].name);
+    }
+    printf("\npolicies:");
+    for (i = 0; i < sizeof policies / sizeof policies[0]; i++) {
+      printf(" %s", policies[i].name);
+    }
+    printf("\n");
     return -1;
   }
-  int numWorkers = atoi(argv[1]);
+  int numWorkers = atoi(argv[optind]);
   if (numWorkers >= MAX_NUM_WORKERS) {
     printf("error: number of workers must be less than %d\n", MAX_NUM_WORKERS);
     return -1;
   }
+  if (migrateLimit > 0 && backend->dropSocket == NULL) {
+    printf("error: the %s backend cannot migrate connections\n", backend->name);
+    return -1;
+  }
+  if (timeoutMillis[TIMEOUT_IDLE] > 0 && backend->sharedSet) {
+    printf("error: the %s backend cannot time out connections\n", backend->name);
+    return -1;
+  }
+  if (docRootFd >= 0 && backend->armSocket == NULL) {
+    printf("error: the %s backend cannot serve files\n", backend->name);
+    return -1;
+  }
+  if (cacheLimit > 0 && docRootFd < 0) {
+    printf("error: -C needs -D\n");
+    return -1;
+  }
+  if (zeroCopyMin > 0 && cacheLimit == 0) {
+    printf("error: -Z needs -C\n");
+    return -1;
+  }
+  if (docRootFd >= 0) {
+    buildTemplate(&BAD_REQUEST, "400 Bad Request", ERROR_HEADERS,
+		  "<html><body><h1>400 Bad Request</h1></body></html>\n");
+    buildTemplate(&NOT_FOUND, "404 Not Found", ERROR_HEADERS,
+		  "<html><body><h1>404 Not Found</h1></body></html>\n");
+    buildTemplate(&NOT_ALLOWED, "405 Method Not Allowed", NOT_ALLOWED_HEADERS,
+		  "<html><body><h1>405 Method Not Allowed</h1></body></html>\n");
+    buildTemplate(&UNAVAILABLE, "503 Service Unavailable", ERROR_HEADERS,
+		  "<html><body><h1>503 Service Unavailable</h1></body></html>\n");
+  }
+  numWorkers = planWorkerCpus(numWorkers, irqDevice);
+  if (numWorkers <= 0 || numWorkers >= MAX_NUM_WORKERS) {
+    printf("error: number of workers must be between 1 and %d\n", MAX_NUM_WORKERS - 1);
+    return -1;
+  }
+
+  // a peer that resets mid-send shows up as EPIPE, not as a signal.
+  signal(SIGPIPE, SIG_IGN);
+  initConnectionTable();
+  initThreadPools(-1);
+  startDateThread();
+  if (cacheLimit > 0) startCacheThread();
+  if (statsInterval > 0 &&
+      pthread_create(&thread, NULL, statsLoop, (void *)(unsigned long) statsInterval)) {
+    perror("pthread_create");
+    exit(-1);
+  }
 
   startWorkers(numWorkers);
 #if !(defined SHOW_PEAK_PERFORMANCE)
   startWakeupThread();
-  startSocketCheckThread();
+  // the debugging build always watches for the stall.
+  if (watchdogMillis == 0) watchdogMillis = 1000;
 #endif
-  acceptLoop(numWorkers);
+  if (watchdogMillis > 0) startWatchdog();
+  if (statsPath != NULL) startStatsServer(statsPath);
+  if (!backend->acceptThread) {
+    // the workers accept for themselves; nothing left to do here.
+    pthread_exit(NULL);
+  }
+  acceptLoop(numWorkers, createListenSocket(0));
   return 0;
 }
 
 void startWorkers(int numWorkers) {
   int i;
-  int efd;
-  for (i=0; i < numWorkers; i++) {
-    if (-1==(efd = epoll_create1(0))) {
-      perror("worker epoll_create1");
-      exit(-1);
-    }
-    workers[i].efd = efd;
-  }
 
+  backend->setup(numWorkers);
+  numWorkersStarted = numWorkers;
   for (i=0; i < numWorkers; i++) {
     startWorkerThread(i);
   }
@@ -128,214 +905,3383 @@ void startWorkers(int numWorkers) {
 
 void startWorkerThread(int w) {
   pthread_t thread;
-  if (pthread_create(&thread, NULL, workerLoop, (void *)(unsigned long) w)) {
+  pthread_attr_t attr;
+  cpu_set_t cpus;
+
+  pthread_attr_init(&attr);
+  if (workerCpu[w] >= 0) {
+    // start the thread on its core, so that nothing it allocates is
+    // first touched elsewhere.
+    CPU_ZERO(&cpus);
+    CPU_SET(workerCpu[w], &cpus);
+    if (pthread_attr_setaffinity_np(&attr, sizeof cpus, &cpus)) {
+      printf("error: cannot pin worker %d to cpu %d\n", w, workerCpu[w]);
+      exit(-1);
+    }
+  }
+  if (pthread_create(&thread, &attr, workerStart, (void *)(unsigned long) w)) {
     perror("pthread_create");
     exit(-1);
   }
+  pthread_attr_destroy(&attr);
   return;
 }
 
-void *workerLoop(void * arg) {
-  int w = (int)(unsigned long) arg;
-  int epfd = workers[w].efd;
-  int n;
-  int i;
-  int sock;
-  struct epoll_event *events;
-  char recvbuf[1000];
-
-  events = calloc (MAX_EVENTS, sizeof (struct epoll_event));
+// Handle a readiness event for a client socket of worker w, whatever
+// backend reported it.
+void serviceSocket(int sock, int w, int writable, char recvbuf[]) {
+  struct conn *c = getConn(sock);
+  int r;
 
-  while(1) {
-    n = epoll_wait(epfd, events, MAX_EVENTS, -1);
-    for (i=0; i < n; i++) {
-      sock = events[i].data.fd;
+  __atomic_store_n(&c->armed, 0, __ATOMIC_RELAXED);
+  if (c->pins != NULL) {
+    reapZeroCopy(sock, w);
+    // the event may have been a completion alone, and a socket that
+    // still owes output is waiting to write, not to read.
+    if (c->files != NULL) writable = 1;
+  }
 #ifdef SHOW_REQUEST
-      m = recv(sock, recvbuf, 200, 0);
-      recvbuf[m]='\0';
-      printf("http request: %s\n", recvbuf);
-      exit(0);
+  int m = recv(sock, recvbuf, 200, 0);
+  recvbuf[m]='\0';
+  printf("http request: %s\n", recvbuf);
+  exit(0);
 #endif
-      receiveLoop(sock, epfd, recvbuf);
+  if (writable) {
+    r = flushOutput(sock, w);
+    if (r < 0) {
+      closeConnection(sock);
+      return;
+    }
+    if (r == 0) {
+      armSocket(sock, w, ARM_WRITE);
+      return;
     }
+    if (measureLatency && c->recvAt != 0) {
+      // the batch that filled the socket has gone out: time it from its
+      // wait and read. A wakeup with no such batch finished nothing.
+      recordLatency(c->waitAt, c->recvAt);
+      c->recvAt = 0;
+    }
+    if (c->closing) {
+      closeConnection(sock);
+      return;
+    }
+    // drained: go back to reading what the client sent meanwhile.
   }
-  pthread_exit(NULL);
+  receiveLoop(sock, w, recvbuf);
 }
 
-void receiveLoop(int sock, int epfd, char recvbuf[]) {
-  ssize_t m;
-  int numSent;
-  struct epoll_event event;
-  int remaining = EXPECTED_RECV_LEN;
+// Drain a listener's accept queue into worker w. In shared mode the
+// listener is one-shot, so only one worker at a time gets here.
+void acceptConnections(int lsd, int w) {
+  int sock_tmp;
 
   while(1) {
-    m = recv(sock, recvbuf, remaining, 0);
-    if (m==0) break;
-    if (m > 0) {
-      remaining = remaining - m;
-      if (remaining == 0) {
-	remaining = EXPECTED_RECV_LEN;
-	numSent = send(sock, RESPONSE, RESPONSE_LEN, 0);
-	if (numSent == -1) {
-	  perror("send failed");
-	  exit(-1);
-	}
-	if (numSent != RESPONSE_LEN) {
-	  perror("partial send");
-	  exit(-1);
-	}
-#if !(defined SHOW_PEAK_PERFORMANCE)
-	if (eventfd_write(evfd, 1)) {
-	  perror("eventfd_write");
-	  exit(-1);
-	}
-#endif
-      } //else {
-	//      if (remaining < 0) {
-	//	perror("remaining < 0");
-	//      }
-	//perror("partial recv");
-	//exit(-1);
-        //}
-    }
-    if (m==-1) {
-      if (errno==EAGAIN) {
-	// re-arm the socket with epoll.
-	event.data.fd = sock;
-	event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-	if (epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &event)) {
-	  perror("rearm epoll_ctl");
-	  exit(-1);
-	}
-	break;
-      } else {
-	perror("recv");
-	exit(-1);
+    if (-1 == (sock_tmp = accept4(lsd, NULL, NULL, SOCK_NONBLOCK))) {
+      if (errno == EAGAIN) return;
+      if (errno == ECONNABORTED || errno == EINTR) continue;
+      if (errno == EMFILE || errno == ENFILE) {
+	shedConnection(lsd, 0);
+	return;
       }
+      if (errno == ENOBUFS || errno == ENOMEM) return;
+      printf("Error %d doing accept", errno);
+      exit(-1);
     }
+    if (newConnection(sock_tmp, w) == NULL) {
+      close(sock_tmp);
+      continue;
+    }
+    if (pinWorkers) countLocality(w, incomingCpu(sock_tmp));
+    registerSocket(sock_tmp, w);
   }
 }
 
-#if !(defined SHOW_PEAK_PERFORMANCE)
-void startWakeupThread(void) {
-  pthread_t wait_thread;
-  if (pthread_create(&wait_thread, NULL, wakeupThreadLoop, NULL) != 0) {
-    perror("Thread create failed.");
-    exit(-1);
+// epoll backends.
+//
+// "epoll": one epoll set per worker, fed by acceptLoop.
+// "reuseport": each worker also gets its own SO_REUSEPORT listen socket
+// in its epoll set, so the kernel spreads incoming connections across
+// workers and an accepted socket never leaves the worker that accepted
+// it.
+// "shared": all workers wait on a single epoll set holding the listen
+// socket and every client socket, so whichever worker is idle picks up
+// the next ready socket. The listener is one-shot too, re-armed once its
+// worker has drained it: EPOLLEXCLUSIVE only picks among epoll sets, and
+// a level-triggered listener would wake every worker waiting on this one.
+// Client sockets are always EPOLLET | EPOLLONESHOT and re-armed by the
+// worker once it has drained them.
+
+void epollSetup(int numWorkers) {
+  int i;
+
+  for (i=0; i < numWorkers; i++) {
+    if (-1==(workers[i].efd = epoll_create1(0))) {
+      perror("worker epoll_create1");
+      exit(-1);
+    }
+    workers[i].lsd = -1;
+    initInbox(i);
+    epollAddListener(workers[i].efd, workers[i].inbox->efd, EPOLLIN);
   }
 }
 
-void * wakeupThreadLoop(void * null) {
+void epollReuseportSetup(int numWorkers) {
+  int i;
 
-  evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-  if (evfd == -1) {
-    perror("eventfd failed");
+  epollSetup(numWorkers);
+  for (i=0; i < numWorkers; i++) {
+    workers[i].lsd = createListenSocket(1);
+    // -d cpu: the kernel prefers the listener whose SO_INCOMING_CPU is
+    // the cpu the SYN arrived on.
+    if (dispatch->pick == dispatchIncomingCpu && workerCpu[i] >= 0 &&
+	setsockopt(workers[i].lsd, SOL_SOCKET, SO_INCOMING_CPU, &workerCpu[i], sizeof (int))) {
+      perror("setsockopt SO_INCOMING_CPU");
+      exit(-1);
+    }
+    epollAddListener(workers[i].efd, workers[i].lsd, EPOLLIN);
+  }
+}
+
+void epollSharedSetup(int numWorkers) {
+  int i;
+  int efd;
+  int sd;
+
+  if (-1==(efd = epoll_create1(0))) {
+    perror("shared epoll_create1");
     exit(-1);
   }
-#ifdef READ_EVENT_FD
-  int epfd;
-  struct epoll_event event;
-  struct epoll_event *events;
-  uint64_t val;
-  int n;
+  sd = createListenSocket(0);
+  epollAddListener(efd, sd, EPOLLIN | EPOLLET | EPOLLONESHOT);
+  for (i=0; i < numWorkers; i++) {
+    workers[i].efd = efd;
+    workers[i].lsd = sd;
+  }
+}
 
-  epfd = epoll_create1(0);
-  events = calloc (1, sizeof event);
-  event.data.fd = evfd;
-  event.events = EPOLLIN;
+void epollAddListener(int efd, int sd, uint32_t events) {
+  struct epoll_event event;
+  setNonBlocking(sd);
+  event.data.fd = sd;
+  event.events = events;
+  if (epoll_ctl(efd, EPOLL_CTL_ADD, sd, &event)) {
+    perror("listen epoll_ctl");
+    exit(-1);
+  }
+}
 
-  if (epoll_ctl (epfd, EPOLL_CTL_ADD, evfd, &event)) {
-    perror("epoll_ctl");
+// Shared mode: let the next connection wake one worker again.
+void epollRearmListener(int efd, int sd) {
+  struct epoll_event event;
+  event.data.fd = sd;
+  event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+  if (epoll_ctl(efd, EPOLL_CTL_MOD, sd, &event)) {
+    perror("listen rearm epoll_ctl");
     exit(-1);
   }
+}
+
+void *epollWorkerLoop(void * arg) {
+  int w = (int)(unsigned long) arg;
+  int epfd = workers[w].efd;
+  int lsd = workers[w].lsd;
+  int inboxFd = workers[w].inbox ? workers[w].inbox->efd : -1;
+  int n = 0;
+  int i;
+  int sock;
+  struct epoll_event *events;
+  char *recvbuf;
+
+  initThreadPools(w);
+  recvbuf = bufAlloc();
+  events = calloc (MAX_EVENTS, sizeof (struct epoll_event));
+
   while(1) {
-    n = epoll_wait(epfd, events, 1, -1);
-    if (n>0) {
-      if (eventfd_read(evfd, &val)) {
-	perror("eventfd_read");
-	exit(-1);
+    if (migrateLimit > 0 && n <= STEAL_IDLE_EVENTS) requestSteal(w);
+    if (cacheLimit > 0) cacheOffline(w);
+    n = epoll_wait(epfd, events, MAX_EVENTS, nextTimeout());
+    if (cacheLimit > 0) cacheOnline(w);
+    countWait(w, n);
+    for (i=0; i < n; i++) {
+      sock = events[i].data.fd;
+      if (sock == lsd) {
+	acceptConnections(lsd, w);
+	if (backend->sharedSet) epollRearmListener(epfd, lsd);
+	continue;
+      }
+      if (sock == inboxFd) {
+	drainInbox(w);
+	continue;
       }
+      serviceSocket(sock, w, events[i].events & EPOLLOUT, recvbuf);
     }
+    if (localWheel != NULL) expireTimeouts(w);
   }
-#else
-  sleep(20);
-#endif
   pthread_exit(NULL);
 }
-#endif
 
-#if !(defined SHOW_PEAK_PERFORMANCE)
-// Sleep for 10 seconds, then show the sockets which have data.
-void startSocketCheckThread(void) {
-  pthread_t thread;
-  if (pthread_create(&thread, NULL, socketCheck, (void *)NULL)) {
-    perror("pthread_create");
+void epollAddSocket(int sock, int w) {
+  struct epoll_event event;
+  event.data.fd = sock;
+  event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+  if (epoll_ctl(workers[w].efd, EPOLL_CTL_ADD, sock, &event)) {
+    perror("accept epoll_ctl");
     exit(-1);
   }
-  return;
 }
 
-void *socketCheck(void * arg) {
-  int i, bytesAvailable;
-  sleep(10);
-  for (i = 0; i < NUM_CLIENTS; i++) {
-    if (ioctl(sockets[i], FIONREAD, &bytesAvailable) < 0) {
-      perror("ioctl");
-      exit(-1);
-    }
-    if (bytesAvailable > 0) {
-      printf("socket %d has %d bytes of data ready\n", sockets[i], bytesAvailable);
-    }
+void epollArmSocket(int sock, int w, int events) {
+  struct epoll_event event;
+  event.data.fd = sock;
+  event.events = (events == ARM_WRITE ? EPOLLOUT : EPOLLIN) | EPOLLET | EPOLLONESHOT;
+  if (epoll_ctl(workers[w].efd, EPOLL_CTL_MOD, sock, &event)) {
+    perror("rearm epoll_ctl");
+    exit(-1);
   }
-  pthread_exit(NULL);
 }
-#endif
-
-void acceptLoop(int numWorkers)
-{
-  int sd;
-  struct sockaddr_in addr;
-  struct epoll_event event;
-  socklen_t alen = sizeof(addr);
-  short port = PORT_NUM;
-  int sock_tmp;
-  int current_worker = 0;
-  int current_client = 0;
-  int optval;
 
-  if (-1 == (sd = socket(PF_INET, SOCK_STREAM, 0))) {
-    printf("socket: error: %d\n",errno);
+void epollDropSocket(int sock, int w) {
+  if (epoll_ctl(workers[w].efd, EPOLL_CTL_DEL, sock, NULL)) {
+    perror("migrate epoll_ctl");
     exit(-1);
   }
+}
 
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons(port);
+#ifdef HAVE_KQUEUE
+// kqueue backends, native on the BSDs and macOS and through the epoll
+// shim in compat/sys/event.h on Linux. Like kqueueserver3 and 4, client
+// sockets are registered EV_ONESHOT and re-added once drained; the
+// connections always come from acceptLoop.
 
-  optval = 1;
-  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
-  if (bind(sd, (struct sockaddr*)&addr, sizeof(addr))) {
-    printf("bind error: %d\n",errno);
-    exit(-1);
+void kqueueSetup(int numWorkers) {
+  int i;
+
+  struct kevent event;
+
+  for (i=0; i < numWorkers; i++) {
+    if (-1==(workers[i].efd = kqueue())) {
+      perror("worker kqueue");
+      exit(-1);
+    }
+    workers[i].lsd = -1;
+    initInbox(i);
+    EV_SET(&event, workers[i].inbox->efd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (kevent(workers[i].efd, &event, 1, NULL, 0, NULL)) {
+      perror("inbox kevent");
+      exit(-1);
+    }
   }
-  if (listen(sd, BACKLOG)) {
-    printf("listen error: %d\n",errno);
+}
+
+void kqueueSharedSetup(int numWorkers) {
+  int i;
+  int kq;
+
+  if (-1==(kq = kqueue())) {
+    perror("shared kqueue");
     exit(-1);
   }
+  for (i=0; i < numWorkers; i++) {
+    workers[i].efd = kq;
+    workers[i].lsd = -1;
+  }
+}
+
+void *kqueueWorkerLoop(void * arg) {
+  int w = (int)(unsigned long) arg;
+  int kq = workers[w].efd;
+  int inboxFd = workers[w].inbox ? workers[w].inbox->efd : -1;
+  int n = 0;
+  int i, timeout;
+  struct kevent *events;
+  struct timespec ts;
+  char *recvbuf;
+
+  initThreadPools(w);
+  recvbuf = bufAlloc();
+  events = calloc (MAX_EVENTS, sizeof (struct kevent));
+
   while(1) {
-    if (-1 == (sock_tmp = accept(sd, (struct sockaddr*)&addr, &alen))) {
-      printf("Error %d doing accept", errno);
+    if (migrateLimit > 0 && n <= STEAL_IDLE_EVENTS) requestSteal(w);
+    timeout = nextTimeout();
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    if (cacheLimit > 0) cacheOffline(w);
+    n = kevent(kq, NULL, 0, events, MAX_EVENTS, timeout < 0 ? NULL : &ts);
+    if (cacheLimit > 0) cacheOnline(w);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror("kevent");
       exit(-1);
     }
-    sockets[current_client] = sock_tmp;
-    setNonBlocking(sock_tmp);
-    event.data.fd = sock_tmp;
-    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-    epoll_ctl(workers[current_worker].efd, EPOLL_CTL_ADD, sock_tmp, &event);
-    current_client++;
-    current_worker = (current_worker + 1) % numWorkers;
+    countWait(w, n);
+    for (i=0; i < n; i++) {
+      if ((int) events[i].ident == inboxFd) {
+	drainInbox(w);
+	continue;
+      }
+      serviceSocket(events[i].ident, w, events[i].filter == EVFILT_WRITE, recvbuf);
+    }
+    if (localWheel != NULL) expireTimeouts(w);
+  }
+  pthread_exit(NULL);
+}
+
+// The fired EV_ONESHOT filter is already gone from the kqueue.
+void kqueueDropSocket(int sock, int w) {
+}
+
+void kqueueAddSocket(int sock, int w) {
+  kqueueArmSocket(sock, w, ARM_READ);
+}
+
+void kqueueArmSocket(int sock, int w, int events) {
+  struct kevent event;
+  EV_SET(&event, sock, events == ARM_WRITE ? EVFILT_WRITE : EVFILT_READ,
+	 EV_ADD | EV_ONESHOT, 0, 0, NULL);
+  if (kevent(workers[w].efd, &event, 1, NULL, 0, NULL)) {
+    perror("rearm kevent");
+    exit(-1);
+  }
+}
+#endif
+
+// HTTP request parsing.
+//
+// Requests are framed in place in the receive buffer: we only look for the
+// "\r\n\r\n" that ends each header block (scanning for '\n' sixteen bytes
+// at a time) and skip any Content-Length body, so nothing is copied or
+// allocated. The few bytes of state needed to find a terminator that
+// straddles two reads live in the connection's http_parser.
+
+// The terminator ends at q (a '\n'); the three bytes before it may lie
+// in an earlier read, in which case they come from p->partial.
+static inline int endsHeader(struct http_parser *p, char *cur, char *q) {
+  int k;
+  for (k = 1; k <= 3; k++) {
+    char b;
+    if (q - k >= cur) {
+      b = q[-k];
+    } else if (p->headerLen - (k - (q - cur)) >= 0) {
+      b = p->partial[p->headerLen - (k - (q - cur))];
+    } else {
+      return 0;
+    }
+    if (b != ((k & 1) ? '\r' : '\n')) return 0;
+  }
+  return 1;
+}
+
+// Return a pointer just past the first header terminator in [cur, end),
+// or NULL if there is none yet.
+static char *findHeaderEnd(struct http_parser *p, char *cur, char *end) {
+  char *s = cur;
+#ifdef __SSE2__
+  __m128i nl = _mm_set1_epi8('\n');
+  while (end - s >= 16) {
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) s), nl));
+    while (mask) {
+      char *q = s + __builtin_ctz(mask);
+      if (endsHeader(p, cur, q)) return q + 1;
+      mask &= mask - 1;
+    }
+    s += 16;
+  }
+#endif
+  while (s < end && (s = memchr(s, '\n', end - s)) != NULL) {
+    if (endsHeader(p, cur, s)) return s + 1;
+    s++;
+  }
+  return NULL;
+}
+
+// Content-Length of the header block [start, end), or -1 if the body
+// is chunked or the length is malformed.
+static long httpBodyLength(char *start, char *end) {
+  char *line = start;
+  char *digits;
+  long len = 0;
+
+  while ((line = memchr(line, '\n', end - line)) != NULL && ++line < end) {
+    if (end - line > 18 && !strncasecmp(line, "transfer-encoding:", 18)) {
+      return -1;
+    }
+    if (end - line > 15 && !strncasecmp(line, "content-length:", 15)) {
+      len = strtol(line + 15, &digits, 10);
+      if (digits == line + 15 || len < 0) return -1;
+    }
+  }
+  return len;
+}
+
+// Frame the next request in buf[*pos, len). Returns 1 and advances *pos
+// past its header block when one completes, 0 once all input has been
+// consumed without completing one, and -1 for a request we cannot serve
+// (oversized header or chunked body). req->start points at the complete
+// header block: in place in buf in the common case, or in a pooled buffer
+// that collected it when it was split across reads. It stays valid until
+// the next call.
+int httpNextRequest(struct http_parser *p, char *buf, int len, int *pos,
+		    struct http_request *req) {
+  char *cur = buf + *pos;
+  char *end = buf + len;
+  char *start = NULL;
+  char *hit;
+  long body;
+
+  if (p->partial != NULL && p->headerLen == 0) {
+    // the split header handed out by the previous call is finished with.
+    poolFree(p->partial);
+    p->partial = NULL;
+  }
+  if (p->bodyRemaining > 0) {
+    long skip = end - cur < p->bodyRemaining ? end - cur : p->bodyRemaining;
+    cur += skip;
+    p->bodyRemaining -= skip;
+  }
+  if (p->headerLen == 0) {
+    // tolerate stray CRLFs between requests
+    while (cur < end && (*cur == '\r' || *cur == '\n')) cur++;
+    if (cur < end) {
+      p->method = *cur;
+      start = cur;
+    }
+  }
+  if (cur == end) {
+    *pos = len;
+    return 0;
+  }
+
+  hit = findHeaderEnd(p, cur, end);
+  if (hit == NULL) {
+    // keep what we have of the header until the rest arrives.
+    if (p->headerLen + (end - cur) > MAX_HEADER_LEN) return -1;
+    if (p->partial == NULL) p->partial = bufAlloc();
+    memcpy(p->partial + p->headerLen, cur, end - cur);
+    p->headerLen += end - cur;
+    *pos = len;
+    return 0;
+  }
+
+  req->headerLen = p->headerLen + (hit - cur);
+  if (req->headerLen > MAX_HEADER_LEN) return -1;
+  if (p->headerLen > 0) {
+    memcpy(p->partial + p->headerLen, cur, hit - cur);
+    start = p->partial;
+  }
+  req->start = start;
+  // GET and HEAD never carry a body; anything else needs its headers.
+  if (p->method != 'G' && p->method != 'H') {
+    if ((body = httpBodyLength(start, start + req->headerLen)) < 0) return -1;
+    p->bodyRemaining = body;
+  }
+  p->headerLen = 0;
+  *pos = hit - buf;
+  return 1;
+}
+
+// Write as much of the connection's queued output as the socket takes,
+// coalescing up to MAX_IOVECS responses into each writev so a pipelined
+// batch costs one syscall. Returns 1 once the queue is empty, 0 if the
+// socket is full, and -1 if the peer has gone away. w is the worker
+// doing the writing. With -D the responses are owed in c->files instead,
+// see flushFiles.
+int flushOutput(int sock, int w) {
+  struct conn *c = getConn(sock);
+  struct response_template *t = &RESPONSE;
+  struct iovec iov[MAX_IOVECS];
+  struct iovec *v;
+  ssize_t numSent;
+  size_t cut;
+  char *base;
+  int b, k, n;
+
+  if (c->files != NULL && (k = flushFiles(sock, w)) <= 0) return k;
+  while (c->outPartial != NULL || c->outCount > 0) {
+    b = __atomic_load_n(&t->current, __ATOMIC_ACQUIRE);
+    base = t->buf[b];
+    v = t->iov[b];
+    k = 0;
+    if (c->outPartial != NULL) {
+      iov[0].iov_base = c->outPartial + c->outPartialOff;
+      iov[0].iov_len = c->outPartialLen - c->outPartialOff;
+      k = 1;
+    }
+    n = c->outCount < MAX_IOVECS - k ? c->outCount : MAX_IOVECS - k;
+    if (k > 0) {
+      memcpy(iov + 1, v, n * sizeof (struct iovec));
+      v = iov;
+    }
+    numSent = writev(sock, v, k + n);
+    if (numSent == -1) {
+      if (errno == EAGAIN) {
+	STAT_ADD(w, eagains, 1);
+	return 0;
+      }
+      if (errno == EINTR) continue;
+      // EPIPE, ECONNRESET, ETIMEDOUT and the like: the connection is gone.
+      STAT_ADD(w, resets, 1);
+      return -1;
+    }
+    STAT_ADD(w, bytesOut, numSent);
+    if (k > 0) {
+      cut = numSent < iov[0].iov_len ? numSent : iov[0].iov_len;
+      c->outPartialOff += cut;
+      numSent -= cut;
+      if (c->outPartialOff < c->outPartialLen) continue;
+      poolFree(c->outPartial);
+      c->outPartial = NULL;
+    }
+    c->outCount -= numSent / t->len;
+    cut = numSent % t->len;
+    if (cut > 0) {
+      // keep the rest of the response that was cut short.
+      c->outCount--;
+      c->outPartial = bufAlloc();
+      c->outPartialOff = 0;
+      c->outPartialLen = t->len - cut;
+      memcpy(c->outPartial, base + cut, c->outPartialLen);
+    }
+  }
+#if !(defined SHOW_PEAK_PERFORMANCE)
+  if (eventfd_write(evfd, 1)) {
+    perror("eventfd_write");
+    exit(-1);
+  }
+#endif
+  return 1;
+}
+
+void armSocket(int sock, int w, int events) {
+  STAT_ADD(w, rearms, 1);
+  armTimeout(getConn(sock), events);
+  backend->armSocket(sock, w, events);
+}
+
+void receiveLoop(int sock, int w, char recvbuf[]) {
+  ssize_t m;
+  struct conn *c = getConn(sock);
+  struct http_request req;
+  uint64_t recvAt = 0;
+  int numRequests;
+  int pos;
+  int r;
+
+  while(1) {
+    m = recv(sock, recvbuf, RECV_BUF_SIZE, 0);
+    if (m==0) {
+      // orderly shutdown by the client.
+      closeConnection(sock);
+      return;
+    }
+    if (m > 0) {
+      STAT_ADD(w, bytesIn, m);
+      if (measureLatency) recvAt = nowNanos();
+      pos = 0;
+      numRequests = 0;
+      while ((r = httpNextRequest(&c->parser, recvbuf, m, &pos, &req)) > 0) {
+	numRequests++;
+	if (docRootFd >= 0 && !queueFile(c, w, &req)) {
+	  // too many owed; drop the connection.
+	  closeConnection(sock);
+	  return;
+	}
+      }
+      if (r < 0) {
+	// a request we cannot frame: answer the ones before it (and it,
+	// with a 400, under -D), then close.
+	if (docRootFd >= 0) queueFile(c, w, NULL);
+	c->closing = 1;
+      }
+      if (numRequests > 0 || c->closing) {
+	c->requests += numRequests;
+	countRequests(w, numRequests);
+	if (docRootFd < 0) c->outCount += numRequests;
+	r = flushOutput(sock, w);
+	if (r < 0) {
+	  closeConnection(sock);
+	  return;
+	}
+	if (r == 0) {
+	  // the client is not reading; stop reading from it until the
+	  // backlog drains, and time the batch until then.
+	  if (measureLatency && numRequests > 0) {
+	    c->waitAt = waitReturnedAt;
+	    c->recvAt = recvAt;
+	  }
+	  armSocket(sock, w, ARM_WRITE);
+	  return;
+	}
+	if (measureLatency && numRequests > 0) recordLatency(waitReturnedAt, recvAt);
+	if (c->closing) {
+	  closeConnection(sock);
+	  return;
+	}
+      }
+    }
+    if (m==-1) {
+      if (errno==EAGAIN) {
+	STAT_ADD(w, eagains, 1);
+	// re-arm the socket with the backend, or with an idle worker's.
+	if (migrateLimit == 0 || !migrateConnection(sock, w)) {
+	  c->arms++;
+	  __atomic_store_n(&c->armed, 1, __ATOMIC_RELAXED);
+	  armSocket(sock, w, ARM_READ);
+	}
+	break;
+      }
+      if (errno==EINTR) continue;
+      // ECONNRESET, ETIMEDOUT and the like: the connection is gone.
+      STAT_ADD(w, resets, 1);
+      closeConnection(sock);
+      return;
+    }
+  }
+}
+
+// io_uring backend.
+//
+// Each worker owns a ring with a multishot accept on the shared listen
+// socket and a multishot recv per connection that draws from a provided
+// buffer ring. Responses go out as a chain of linked sends, so a socket
+// is never re-armed and the worker only enters the kernel once per
+// batch of completions.
+
+#define URING_OP_ACCEPT 1ULL
+#define URING_OP_RECV 2ULL
+#define URING_OP_SEND 3ULL
+#define URING_OP_SEND_LAST 4ULL
+#define URING_OP_CANCEL 5ULL
+#define URING_OP_BACKOFF 6ULL // re-arm the accept, see uringArmBackoff
+#define URING_DATA(op, fd) (((op) << 32) | (uint32_t)(fd))
+
+static inline void storeRelease(unsigned *p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline unsigned loadAcquire(unsigned *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void uringSetup(struct uring *ring) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size;
+  int i;
+
+  memset(&p, 0, sizeof p);
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_ENTRIES * 4;
+  if (-1 == (ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p))) {
+    perror("io_uring_setup");
+    exit(-1);
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_CQE_SKIP) ||
+      (timeoutMillis[TIMEOUT_IDLE] > 0 && !(p.features & IORING_FEAT_EXT_ARG))) {
+    printf("error: kernel io_uring is too old for this backend\n");
+    exit(-1);
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > sq_size) sq_size = cq_size;
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    perror("mmap sq ring");
+    exit(-1);
+  }
+  cq_ptr = sq_ptr;
+  ring->sq_head = sq_ptr + p.sq_off.head;
+  ring->sq_tail = sq_ptr + p.sq_off.tail;
+  ring->sq_mask = sq_ptr + p.sq_off.ring_mask;
+  ring->sq_array = sq_ptr + p.sq_off.array;
+  ring->cq_head = cq_ptr + p.cq_off.head;
+  ring->cq_tail = cq_ptr + p.cq_off.tail;
+  ring->cq_mask = cq_ptr + p.cq_off.ring_mask;
+  ring->cqes = cq_ptr + p.cq_off.cqes;
+  ring->sq_entries = p.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->to_submit = 0;
+
+  ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    perror("mmap sqes");
+    exit(-1);
+  }
+
+  // provided buffer ring for multishot recv
+  ring->br = mmap(NULL, URING_NUM_BUFS * sizeof(struct io_uring_buf),
+		  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->bufs = malloc(URING_NUM_BUFS * URING_BUF_SIZE);
+  if (ring->br == MAP_FAILED || ring->bufs == NULL) {
+    perror("buffer ring allocation");
+    exit(-1);
+  }
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = (unsigned long) ring->br;
+  reg.ring_entries = URING_NUM_BUFS;
+  reg.bgid = URING_BGID;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    perror("io_uring_register pbuf ring");
+    exit(-1);
+  }
+  for (i = 0; i < URING_NUM_BUFS; i++) {
+    struct io_uring_buf *buf = &ring->br->bufs[i];
+    buf->addr = (unsigned long) (ring->bufs + i * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = i;
+  }
+  ring->br_tail = URING_NUM_BUFS;
+  __atomic_store_n(&ring->br->tail, (unsigned short) ring->br_tail, __ATOMIC_RELEASE);
+}
+
+// Hand a consumed buffer back to the kernel.
+static inline void uringRecycleBuffer(struct uring *ring, unsigned short bid) {
+  struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_NUM_BUFS - 1)];
+  buf->addr = (unsigned long) (ring->bufs + bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  ring->br_tail++;
+  __atomic_store_n(&ring->br->tail, (unsigned short) ring->br_tail, __ATOMIC_RELEASE);
+}
+
+// Publish queued sqes and wait for a cqe the way epoll_wait would:
+// not at all if waitMs is 0, for ever if it is -1, else at most waitMs.
+void uringSubmit(struct uring *ring, int waitMs) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = waitMs ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+
+  if (waitMs > 0) {
+    memset(&arg, 0, sizeof arg);
+    ts.tv_sec = waitMs / 1000;
+    ts.tv_nsec = (waitMs % 1000) * 1000000L;
+    arg.ts = (unsigned long) &ts;
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  storeRelease(ring->sq_tail, ring->sq_local_tail);
+  do {
+    ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, waitMs ? 1 : 0,
+		  flags, waitMs > 0 ? &arg : NULL, waitMs > 0 ? sizeof arg : 0);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1 && errno == ETIME) ret = 0; // timed out with nothing to submit
+  if (ret == -1) {
+    perror("io_uring_enter");
+    exit(-1);
+  }
+  ring->to_submit -= ret;
+}
+
+struct io_uring_sqe *uringGetSqe(struct uring *ring) {
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+  while (ring->sq_local_tail - loadAcquire(ring->sq_head) >= ring->sq_entries) {
+    uringSubmit(ring, 0);
+  }
+  idx = ring->sq_local_tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof *sqe);
+  ring->sq_array[idx] = idx;
+  ring->sq_local_tail++;
+  ring->to_submit++;
+  return sqe;
+}
+
+void uringArmAccept(struct uring *ring, int sd) {
+  struct io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = sd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = URING_DATA(URING_OP_ACCEPT, sd);
+}
+
+// Out of fds: re-arm the accept on sd once SHED_WAIT_MS have passed
+// instead of at once, which would only fail again. The ring waits, not
+// the worker, which goes on serving its connections meanwhile.
+void uringArmBackoff(struct uring *ring, int sd) {
+  static struct __kernel_timespec ts = { 0, SHED_WAIT_MS * 1000000L };
+  struct io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (unsigned long) &ts;
+  sqe->len = 1;
+  sqe->user_data = URING_DATA(URING_OP_BACKOFF, sd);
+}
+
+void uringArmRecv(struct uring *ring, int sock) {
+  struct io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sock;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = URING_DATA(URING_OP_RECV, sock);
+}
+
+// End everything outstanding on sock: its recv, and any sends, which a
+// shutdown does not always wake once the peer has stopped reading.
+void uringCancel(struct uring *ring, int sock) {
+  struct io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = sock;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = URING_DATA(URING_OP_CANCEL, sock);
+}
+
+// Queue the owed responses as one chain of linked sends. Only the last
+// link posts a completion on success; if a link fails (or is short,
+// given MSG_WAITALL), it posts one and the kernel cancels the rest of
+// the chain without posting theirs, since a failing
+// IOSQE_CQE_SKIP_SUCCESS link hides its successors' completions. Either
+// way exactly one completion ends the chain and clears inflight.
+// Keeping one chain in flight per socket preserves response order
+// across batches.
+void uringSendResponses(struct uring *ring, int sock) {
+  struct conn *c = getConn(sock);
+  struct io_uring_sqe *sqe;
+  int n = c->pending < MAX_LINKED_SENDS ? c->pending : MAX_LINKED_SENDS;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = (unsigned long) RESPONSE.buf[__atomic_load_n(&RESPONSE.current, __ATOMIC_ACQUIRE)];
+    sqe->len = RESPONSE.len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    if (i < n - 1) {
+      sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+      sqe->user_data = URING_DATA(URING_OP_SEND, sock);
+    } else {
+      sqe->user_data = URING_DATA(URING_OP_SEND_LAST, sock);
+    }
+  }
+  c->pending -= n;
+  c->inflight = 1;
+  armTimeout(c, ARM_WRITE);
+  // counted when queued: only a failed chain reports back per send.
+  STAT_ADD(c->owner, bytesOut, n * RESPONSE.len);
+}
+
+void uringRecv(struct uring *ring, int sock, struct io_uring_cqe *cqe) {
+  struct conn *c = getConn(sock);
+  struct http_request req;
+  unsigned short bid;
+  int pos = 0;
+  int r = 0;
+  int n = 0;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0) {
+      while ((r = httpNextRequest(&c->parser, ring->bufs + bid * URING_BUF_SIZE,
+				  cqe->res, &pos, &req)) > 0) {
+	n++;
+      }
+      if (measureLatency && n > 0 && c->recvAt == 0) {
+	c->waitAt = waitReturnedAt;
+	c->recvAt = nowNanos();
+      }
+      c->pending += n;
+      c->requests += n;
+      countRequests(c->owner, n);
+      STAT_ADD(c->owner, bytesIn, cqe->res);
+    }
+    uringRecycleBuffer(ring, bid);
+  }
+  if (r < 0) {
+    // a request we cannot frame: the recv terminates once we shut down
+    // reading, and the connection closes once the responses owed for the
+    // requests before it have been sent.
+    shutdown(sock, SHUT_RD);
+  }
+  if (c->pending && !c->inflight) {
+    uringSendResponses(ring, sock);
+  }
+  // while sends are in flight, the write timeout set for them stands.
+  if (!c->inflight) armTimeout(c, ARM_READ);
+  if (cqe->flags & IORING_CQE_F_MORE) return;
+
+  // The multishot recv has terminated. Running out of provided buffers
+  // or a spurious stop just needs a re-arm; EOF or an error ends the
+  // connection once its sends have drained.
+  if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+    uringArmRecv(ring, sock);
+    return;
+  }
+  if (cqe->res < 0 && cqe->res != -ECANCELED) STAT_ADD(c->owner, resets, 1);
+  if (c->inflight) {
+    c->closing = 1;
+  } else {
+    closeConnection(sock);
+  }
+}
+
+void uringSendDone(struct uring *ring, int sock, struct io_uring_cqe *cqe, int last) {
+  struct conn *c = getConn(sock);
+
+  if (!last || cqe->res < (int) RESPONSE.len) {
+    // The peer is gone (or the connection timed out); make the
+    // outstanding recv terminate too.
+    c->pending = 0;
+    shutdown(sock, SHUT_RDWR);
+  }
+  c->inflight = 0;
+  if (measureLatency && c->recvAt != 0 && c->pending == 0) {
+    recordLatency(c->waitAt, c->recvAt);
+    c->recvAt = 0;
+  }
+  if (c->closing) {
+    closeConnection(sock);
+    return;
+  }
+  if (c->pending) {
+    uringSendResponses(ring, sock);
+  } else {
+    armTimeout(c, ARM_READ);
+  }
+}
+
+// Every worker puts a multishot accept for the same listen socket on its
+// own ring.
+void uringSetupWorkers(int numWorkers) {
+  int sd = createListenSocket(0);
+  int i;
+
+  for (i=0; i < numWorkers; i++) {
+    workers[i].efd = -1;
+    workers[i].lsd = sd;
+  }
+}
+
+void *uringWorkerLoop(void * arg) {
+  int w = (int)(unsigned long) arg;
+  int sd = workers[w].lsd;
+  struct uring ring;
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  uint64_t op;
+  int fd;
+
+  initThreadPools(w);
+  uringSetup(&ring);
+  localRing = &ring;
+  uringArmAccept(&ring, sd);
+
+  while(1) {
+    uringSubmit(&ring, nextTimeout());
+    head = *ring.cq_head;
+    tail = loadAcquire(ring.cq_tail);
+    countWait(w, tail - head);
+    for (; head != tail; head++) {
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      op = cqe->user_data >> 32;
+      fd = (int)(uint32_t) cqe->user_data;
+      switch (op) {
+      case URING_OP_ACCEPT:
+	if (cqe->res >= 0) {
+	  if (newConnection(cqe->res, w) == NULL) {
+	    close(cqe->res);
+	  } else {
+	    if (pinWorkers) countLocality(w, incomingCpu(cqe->res));
+	    armTimeout(getConn(cqe->res), ARM_READ);
+	    uringArmRecv(&ring, cqe->res);
+	  }
+	} else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+	  shedConnection(sd, 0);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE) break;
+	if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+	  uringArmBackoff(&ring, sd);
+	} else {
+	  uringArmAccept(&ring, sd);
+	}
+	break;
+      case URING_OP_BACKOFF:
+	uringArmAccept(&ring, sd);
+	break;
+      case URING_OP_RECV:
+	uringRecv(&ring, fd, cqe);
+	break;
+      case URING_OP_SEND:
+	uringSendDone(&ring, fd, cqe, 0);
+	break;
+      case URING_OP_SEND_LAST:
+	uringSendDone(&ring, fd, cqe, 1);
+	break;
+      case URING_OP_CANCEL:
+	break;
+      }
+    }
+    storeRelease(ring.cq_head, head);
+    if (localWheel != NULL) expireTimeouts(w);
+  }
+  pthread_exit(NULL);
+}
+
+#if !(defined SHOW_PEAK_PERFORMANCE)
+void startWakeupThread(void) {
+  pthread_t wait_thread;
+  if (pthread_create(&wait_thread, NULL, wakeupThreadLoop, NULL) != 0) {
+    perror("Thread create failed.");
+    exit(-1);
+  }
+}
+
+void * wakeupThreadLoop(void * null) {
+
+  evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (evfd == -1) {
+    perror("eventfd failed");
+    exit(-1);
+  }
+#ifdef READ_EVENT_FD
+  int epfd;
+  struct epoll_event event;
+  struct epoll_event *events;
+  uint64_t val;
+  int n;
+
+  epfd = epoll_create1(0);
+  events = calloc (1, sizeof event);
+  event.data.fd = evfd;
+  event.events = EPOLLIN;
+
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, evfd, &event)) {
+    perror("epoll_ctl");
+    exit(-1);
+  }
+  while(1) {
+    n = epoll_wait(epfd, events, 1, -1);
+    if (n>0) {
+      if (eventfd_read(evfd, &val)) {
+	perror("eventfd_read");
+	exit(-1);
+      }
+    }
   }
+#else
+  sleep(20);
+#endif
+  pthread_exit(NULL);
 }
+#endif
+
+// Lost-wakeup watchdog.
+//
+// The stall this program was written to show is a socket that is armed
+// in an event set, has input waiting, and never gets an event. Every
+// half -w period the watchdog walks the connection table and asks the
+// kernel how much input each armed socket holds. A socket is suspect
+// from the first sample that finds input; if a later sample finds it
+// still armed, still holding input and not re-armed in between (arms is
+// unchanged), it has stalled. Busy sockets are re-armed far more often
+// than that and never qualify. With -r the owning worker is told to
+// re-arm the socket through its inbox; backends whose workers share an
+// event set have no inbox, and their stalls are only reported.
+
+static uint64_t nowMillis(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void startWatchdog(void) {
+  pthread_t thread;
+  if (NULL == (watchSlots = calloc(maxFds, sizeof (struct watch_slot)))) {
+    perror("calloc watchSlots");
+    exit(-1);
+  }
+  if (pthread_create(&thread, NULL, watchdogLoop, NULL)) {
+    perror("pthread_create");
+    exit(-1);
+  }
+}
+
+void *watchdogLoop(void *arg) {
+  struct timespec ts;
+  struct watch_slot *ws;
+  struct conn *c;
+  uint64_t now, serial, requests;
+  uint32_t arms;
+  int i, bytesAvailable, w, armed;
+
+  ts.tv_sec = watchdogMillis / 2 / 1000;
+  ts.tv_nsec = (watchdogMillis / 2 % 1000) * 1000000L;
+  while (1) {
+    nanosleep(&ts, NULL);
+    now = nowMillis();
+    for (i = 0; i < __atomic_load_n(&connHighWater, __ATOMIC_RELAXED); i++) {
+      if (__atomic_load_n(&connChunks[i >> CONN_CHUNK_BITS], __ATOMIC_ACQUIRE) == NULL ||
+	  (c = __atomic_load_n(&connChunks[i >> CONN_CHUNK_BITS][i & (CONN_CHUNK_SIZE - 1)],
+			       __ATOMIC_ACQUIRE)) == NULL) continue;
+      // c may be closed, freed to its pool and handed out again while
+      // we look, so read it seqlock-style: whatever we read between two
+      // loads of the same nonzero serial was that connection's, the
+      // FIONREAD on its fd included, since close comes last.
+      serial = __atomic_load_n(&c->serial, __ATOMIC_ACQUIRE);
+      armed = __atomic_load_n(&c->armed, __ATOMIC_RELAXED);
+      arms = __atomic_load_n(&c->arms, __ATOMIC_RELAXED);
+      w = __atomic_load_n(&c->owner, __ATOMIC_RELAXED);
+      requests = __atomic_load_n(&c->requests, __ATOMIC_RELAXED);
+      if (armed && ioctl(i, FIONREAD, &bytesAvailable) < 0) armed = 0;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (serial == 0 || __atomic_load_n(&c->serial, __ATOMIC_RELAXED) != serial) continue;
+      ws = &watchSlots[i];
+      if (ws->serial != serial) {
+	ws->serial = serial;
+	ws->since = 0;
+      }
+      if (!armed || bytesAvailable == 0) {
+	ws->since = 0;
+	continue;
+      }
+      if (ws->since == 0 || ws->arms != arms) {
+	ws->arms = arms;
+	ws->since = now;
+	continue;
+      }
+      if (now - ws->since < watchdogMillis) continue;
+      stallsFound[w]++;
+      printf("watchdog: socket %d of worker %d armed for %lums with %d bytes unread,"
+	     " %lu requests served\n", i, w, now - ws->since, bytesAvailable, requests);
+      if (watchdogRearm && workers[w].inbox != NULL && sendMessage(w, MSG_REARM, i, arms)) {
+	stallsRearmed[w]++;
+      }
+      // report it again if it is still stuck a period from now.
+      ws->since = now;
+    }
+    fflush(stdout);
+  }
+  pthread_exit(NULL);
+}
+
+int createListenSocket(int reusePort)
+{
+  int sd;
+  struct sockaddr_in addr;
+  short port = PORT_NUM;
+  int optval;
+
+  if (-1 == (sd = socket(PF_INET, SOCK_STREAM, 0))) {
+    printf("socket: error: %d\n",errno);
+    exit(-1);
+  }
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+
+  optval = 1;
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+  if (reusePort &&
+      setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval)) {
+    perror("setsockopt SO_REUSEPORT");
+    exit(-1);
+  }
+  // accepted sockets inherit it
+  if (zeroCopyMin > 0 &&
+      setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof optval)) {
+    perror("setsockopt SO_ZEROCOPY");
+    exit(-1);
+  }
+  if (bind(sd, (struct sockaddr*)&addr, sizeof(addr))) {
+    printf("bind error: %d\n",errno);
+    exit(-1);
+  }
+  if (listen(sd, BACKLOG)) {
+    printf("listen error: %d\n",errno);
+    exit(-1);
+  }
+  return sd;
+}
+
+void acceptLoop(int numWorkers, int sd)
+{
+  struct sockaddr_in addr;
+  socklen_t alen = sizeof(addr);
+  int sock_tmp;
+  int current_worker;
+  int cpu;
+
+  while(1) {
+    if (-1 == (sock_tmp = accept(sd, (struct sockaddr*)&addr, &alen))) {
+      if (errno == EMFILE || errno == ENFILE) {
+	shedConnection(sd, SHED_WAIT_MS);
+	continue;
+      }
+      if (errno == ECONNABORTED || errno == EINTR ||
+	  errno == ENOBUFS || errno == ENOMEM) continue;
+      printf("Error %d doing accept", errno);
+      exit(-1);
+    }
+    cpu = pinWorkers ? incomingCpu(sock_tmp) : -1;
+    current_worker = dispatch->pick(cpu, numWorkers);
+    if (newConnection(sock_tmp, current_worker) == NULL) {
+      close(sock_tmp);
+      continue;
+    }
+    countLocality(current_worker, cpu);
+    setNonBlocking(sock_tmp);
+    handOff(sock_tmp, current_worker, MSG_ACCEPTED);
+  }
+}
+
+// Raise the fd limit as far as we are allowed and size the chunk
+// directory for it. No connection slots are allocated up front.
+void initConnectionTable(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl)) {
+    perror("getrlimit");
+    exit(-1);
+  }
+  if (rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+  }
+  maxFds = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 24)) ?
+    (1 << 24) : rl.rlim_cur;
+  numConnChunks = (maxFds + CONN_CHUNK_SIZE - 1) / CONN_CHUNK_SIZE;
+  if (NULL == (connChunks = calloc(numConnChunks, sizeof (struct conn **)))) {
+    perror("calloc connChunks");
+    exit(-1);
+  }
+  if (-1 == (spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC))) {
+    perror("open /dev/null");
+    exit(-1);
+  }
+}
+
+// Accept failed with no fd to spare. If a connection is queued on lsd,
+// free the spare fd long enough to accept it and close it at once: the
+// client is refused now instead of waiting in the backlog, and the
+// listen socket, which stays readable, does not spin the caller. With
+// nothing queued (accept reports EMFILE before it looks), wait up to
+// waitMs for a connection and let the caller try again, as fds may have
+// been freed by then. Whoever takes the spare first sheds; concurrent
+// callers just return.
+void shedConnection(int lsd, int waitMs) {
+  struct pollfd pfd = { lsd, POLLIN, 0 };
+  int fd, sock;
+
+  if (poll(&pfd, 1, 0) <= 0) {
+    if (waitMs > 0) poll(&pfd, 1, waitMs);
+    return;
+  }
+  if (-1 == (fd = __atomic_exchange_n(&spareFd, -1, __ATOMIC_ACQUIRE))) return;
+  close(fd);
+  if (-1 != (sock = accept4(lsd, NULL, NULL, SOCK_NONBLOCK))) close(sock);
+  __atomic_store_n(&spareFd, open("/dev/null", O_RDONLY | O_CLOEXEC), __ATOMIC_RELEASE);
+}
+
+// Create the connection for a freshly accepted fd, allocating its table
+// chunk if this is the first fd in that range. Returns NULL if fd is
+// beyond the table.
+struct conn *newConnection(int fd, int owner) {
+  struct conn ***chunk;
+  struct conn **slots;
+  struct conn *c;
+  int hw;
+
+  if (fd >= maxFds) return NULL;
+  chunk = &connChunks[fd >> CONN_CHUNK_BITS];
+  if (__atomic_load_n(chunk, __ATOMIC_ACQUIRE) == NULL) {
+    pthread_mutex_lock(&connTableLock);
+    if (*chunk == NULL) {
+      if (NULL == (slots = calloc(CONN_CHUNK_SIZE, sizeof (struct conn *)))) {
+	perror("connection table chunk");
+	exit(-1);
+      }
+      __atomic_store_n(chunk, slots, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&connTableLock);
+  }
+  c = poolAlloc(&localPools->conns);
+  memset(c, 0, sizeof (struct conn));
+  c->owner = owner;
+  c->fd = fd;
+  __atomic_store_n(&c->serial, __atomic_add_fetch(&connSerial, 1, __ATOMIC_RELAXED),
+		   __ATOMIC_RELEASE);
+  __atomic_fetch_add(&workerLoad[owner].active, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&(*chunk)[fd & (CONN_CHUNK_SIZE - 1)], c, __ATOMIC_RELEASE);
+  hw = __atomic_load_n(&connHighWater, __ATOMIC_RELAXED);
+  while (fd >= hw &&
+	 !__atomic_compare_exchange_n(&connHighWater, &hw, fd + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return c;
+}
+
+// Free the connection and its slot, then the fd. Only the owner closes
+// a connection, and only while it holds no event registration that could
+// still fire: client sockets are one-shot and this runs while handling
+// their event, so closing the fd is all the deregistration needed (no
+// socket is ever dup'ed, so this is the last reference and the kernel
+// drops it from the epoll set or kqueue). Closing must come last, since
+// the fd number can be reused by the next accept at once.
+void closeConnection(int sock) {
+  struct conn *c = getConn(sock);
+  connChunks[sock >> CONN_CHUNK_BITS][sock & (CONN_CHUNK_SIZE - 1)] = NULL;
+  // the watchdog may still be looking at c: make it drop what it read
+  // before anything else changes.
+  __atomic_store_n(&c->serial, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&c->armed, 0, __ATOMIC_RELAXED);
+  cancelTimeout(c);
+  STAT_ADD(c->owner, closes, 1);
+  __atomic_fetch_sub(&workerLoad[c->owner].active, 1, __ATOMIC_RELAXED);
+  if (c->parser.partial != NULL) poolFree(c->parser.partial);
+  if (c->outPartial != NULL) poolFree(c->outPartial);
+  if (c->files != NULL) freeFileQueue(c->files);
+  if (c->pins != NULL) freeZeroCopyPins(c->pins);
+  poolFree(c);
+  close(sock);
+}
+
+// CPU and NUMA placement.
+//
+// -P pins worker w to the w-th CPU we are allowed to run on (wrapping
+// around). -Q netdev pins workers to the CPUs that service netdev's
+// receive queue interrupts instead, so a connection's packets and its
+// worker share a core; #workers 0 then means one worker per queue.
+// A pinned worker also asks for memory from its CPU's node before it
+// allocates anything: its pools, event array and receive buffer, and for
+// io_uring its rings, all come from that node. Epoll sets, listen sockets
+// and, in the acceptLoop backends, the connection objects are still
+// created by the main thread.
+
+// Node of cpu, from sysfs, or -1 if the kernel has no NUMA topology.
+static int cpuNode(int cpu) {
+  char path[64];
+  struct dirent *d;
+  DIR *dir;
+  int node = -1;
+
+  snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+  if ((dir = opendir(path)) == NULL) return -1;
+  while ((d = readdir(dir)) != NULL) {
+    if (!strncmp(d->d_name, "node", 4) && isdigit(d->d_name[4])) {
+      node = atoi(d->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+// First CPU an interrupt is delivered to, or -1.
+static int irqCpu(int irq) {
+  char path[64];
+  FILE *f;
+  int cpu = -1;
+
+  snprintf(path, sizeof path, "/proc/irq/%d/effective_affinity_list", irq);
+  if ((f = fopen(path, "r")) == NULL) {
+    snprintf(path, sizeof path, "/proc/irq/%d/smp_affinity_list", irq);
+    if ((f = fopen(path, "r")) == NULL) return -1;
+  }
+  if (fscanf(f, "%d", &cpu) != 1) cpu = -1;
+  fclose(f);
+  return cpu;
+}
+
+// Fill cpus with the CPUs handling dev's receive interrupts, in IRQ
+// order, and return how many there are. Interrupts are named after the
+// interface (eth0-rx-0, eth0-TxRx-3) or after its underlying device
+// (virtio3-input.0, mlx5_comp0@pci:0000:3b:00.0); when some of them are
+// marked rx/input only those are used.
+static int irqCpus(const char *dev, int cpus[], int max) {
+  char path[256], link[256], line[1024];
+  char *devName = NULL;
+  char *name;
+  int irqs[MAX_NUM_WORKERS];
+  int rx[MAX_NUM_WORKERS];
+  int n = 0, numRx = 0;
+  int i, len, irq;
+  FILE *f;
+
+  snprintf(path, sizeof path, "/sys/class/net/%s/device", dev);
+  if ((len = readlink(path, link, sizeof link - 1)) > 0) {
+    link[len] = '\0';
+    devName = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+  }
+  if ((f = fopen("/proc/interrupts", "r")) == NULL) {
+    perror("/proc/interrupts");
+    exit(-1);
+  }
+  while (n < MAX_NUM_WORKERS && fgets(line, sizeof line, f) != NULL) {
+    if (sscanf(line, " %d:", &irq) != 1) continue;
+    line[strcspn(line, "\n")] = '\0';
+    name = strrchr(line, ' ') ? strrchr(line, ' ') + 1 : line;
+    if (!strstr(name, dev) && (devName == NULL || !strstr(name, devName))) continue;
+    if (strstr(name, "config")) continue;
+    irqs[n] = irq;
+    rx[n] = strcasestr(name, "rx") != NULL || strcasestr(name, "input") != NULL;
+    numRx += rx[n];
+    n++;
+  }
+  fclose(f);
+  for (i = 0, len = 0; i < n && len < max; i++) {
+    if (numRx > 0 && !rx[i]) continue;
+    if ((cpus[len] = irqCpu(irqs[i])) >= 0) len++;
+  }
+  return len;
+}
+
+// Decide where each worker runs and return the worker count, which -Q
+// with #workers 0 takes from the number of receive queue interrupts.
+int planWorkerCpus(int numWorkers, const char *irqDevice) {
+  int cpus[MAX_NUM_WORKERS];
+  cpu_set_t allowed;
+  int n = 0;
+  int i;
+
+  for (i = 0; i < MAX_NUM_WORKERS; i++) {
+    workerCpu[i] = -1;
+    workerNode[i] = -1;
+  }
+  for (i = 0; i < CPU_SETSIZE; i++) {
+    cpuWorker[i] = -1;
+  }
+  if (!pinWorkers) return numWorkers;
+  if (irqDevice != NULL) {
+    if ((n = irqCpus(irqDevice, cpus, MAX_NUM_WORKERS)) == 0) {
+      printf("error: no receive interrupts found for %s\n", irqDevice);
+      exit(-1);
+    }
+    if (numWorkers == 0) numWorkers = n;
+  } else {
+    if (sched_getaffinity(0, sizeof allowed, &allowed)) {
+      perror("sched_getaffinity");
+      exit(-1);
+    }
+    for (i = 0; i < CPU_SETSIZE && n < MAX_NUM_WORKERS; i++) {
+      if (CPU_ISSET(i, &allowed)) cpus[n++] = i;
+    }
+  }
+  for (i = 0; i < numWorkers && i < MAX_NUM_WORKERS; i++) {
+    workerCpu[i] = cpus[i % n];
+    workerNode[i] = cpuNode(workerCpu[i]);
+    if (workerCpu[i] < CPU_SETSIZE && cpuWorker[workerCpu[i]] < 0) {
+      cpuWorker[workerCpu[i]] = i;
+    }
+    printf("worker %d: cpu %d node %d\n", i, workerCpu[i], workerNode[i]);
+  }
+  return numWorkers;
+}
+
+// Every worker thread starts here: set its memory policy, then run the
+// backend's loop.
+void *workerStart(void *arg) {
+  int w = (int)(unsigned long) arg;
+  unsigned long nodes;
+
+  if (workerNode[w] >= 0 && workerNode[w] < 8 * (int) sizeof nodes - 1) {
+    nodes = 1UL << workerNode[w];
+    // MPOL_PREFERRED rather than MPOL_BIND: fall back to other nodes
+    // instead of failing when this one runs out.
+    if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, &nodes, 8 * sizeof nodes)) {
+      perror("set_mempolicy");
+    }
+  }
+  if (measureLatency) {
+    // allocated here so that it comes from the worker's node
+    if (NULL == (localLatency = calloc(1, sizeof (struct worker_latency)))) {
+      perror("calloc latency");
+      exit(-1);
+    }
+    __atomic_store_n(&workerLatency[w], localLatency, __ATOMIC_RELEASE);
+  }
+  if (timeoutMillis[TIMEOUT_IDLE] > 0) {
+    if (NULL == (localWheel = calloc(1, sizeof (struct timer_wheel)))) {
+      perror("calloc timer wheel");
+      exit(-1);
+    }
+    localWheel->now = nowMillis();
+    localWheel->tick = localWheel->now / TIMER_TICK_MS + 1;
+  }
+  if (docRootFd >= 0) {
+    if (NULL == (localFiles = calloc(1, sizeof (struct file_cache)))) {
+      perror("calloc file cache");
+      exit(-1);
+    }
+    __atomic_store_n(&fileCaches[w], localFiles, __ATOMIC_RELEASE);
+  }
+  return backend->workerLoop(arg);
+}
+
+// Connection dispatch.
+//
+// With pinned workers every new connection is scored: a hit when its
+// packets are processed on the cpu of the worker that serves it (the
+// kernel reports the cpu that last handled the socket's packets as
+// SO_INCOMING_CPU), a miss otherwise. -S prints the counts, so the
+// policies can be compared on locality as well as on latency.
+
+int dispatchRoundRobin(int cpu, int numWorkers) {
+  static int next;
+  int w = next;
+  next = (next + 1) % numWorkers;
+  return w;
+}
+
+// Fall back to round robin when no worker is pinned to that cpu.
+int dispatchIncomingCpu(int cpu, int numWorkers) {
+  if (cpu >= 0 && cpu < CPU_SETSIZE && cpuWorker[cpu] >= 0 && cpuWorker[cpu] < numWorkers) {
+    return cpuWorker[cpu];
+  }
+  return dispatchRoundRobin(cpu, numWorkers);
+}
+
+int dispatchLeastConnections(int cpu, int numWorkers) {
+  long min = __atomic_load_n(&workerLoad[0].active, __ATOMIC_RELAXED);
+  long a;
+  int i, w = 0;
+
+  for (i = 1; i < numWorkers; i++) {
+    a = __atomic_load_n(&workerLoad[i].active, __ATOMIC_RELAXED);
+    if (a < min) {
+      min = a;
+      w = i;
+    }
+  }
+  return w;
+}
+
+// Compare two different random workers on the requests they served in
+// the last second plus the sockets they have waiting, counting the
+// connections still in their inboxes; connections break ties. Unlike
+// least, a worker stuck with one hot client stops getting more.
+int dispatchTwoChoices(int cpu, int numWorkers) {
+  static uint32_t seed = 2463534242U;
+  struct msg_queue *q;
+  uint64_t load[2];
+  int w[2];
+  int k;
+
+  if (numWorkers == 1) return 0;
+  for (k = 0; k < 2; k++) {
+    // xorshift32; only the accept thread calls us.
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    // the second from the other numWorkers - 1, so never w[0] again
+    w[k] = k == 0 ? seed % numWorkers : (w[0] + 1 + seed % (numWorkers - 1)) % numWorkers;
+    load[k] = __atomic_load_n(&workerLoad[w[k]].rate, __ATOMIC_RELAXED) +
+      __atomic_load_n(&workerLoad[w[k]].queueDepth, __ATOMIC_RELAXED);
+    // a burst of accepts outruns both of those
+    if ((q = workers[w[k]].inbox) != NULL) {
+      load[k] += __atomic_load_n(&q->tail, __ATOMIC_RELAXED) -
+	__atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+  }
+  if (load[0] != load[1]) return load[0] < load[1] ? w[0] : w[1];
+  return __atomic_load_n(&workerLoad[w[0]].active, __ATOMIC_RELAXED) <=
+    __atomic_load_n(&workerLoad[w[1]].active, __ATOMIC_RELAXED) ? w[0] : w[1];
+}
+
+// Turn the request counters into requests/sec; dateLoop calls this once
+// a second.
+void sampleLoad(void) {
+  uint64_t r;
+  int i;
+
+  for (i = 0; i < numWorkersStarted; i++) {
+    r = __atomic_load_n(&workerLoad[i].requests, __ATOMIC_RELAXED);
+    __atomic_store_n(&workerLoad[i].rate, r - workerLoad[i].lastRequests, __ATOMIC_RELAXED);
+    workerLoad[i].lastRequests = r;
+  }
+}
+
+void printLoadStats(FILE *out) {
+  struct msg_queue *q;
+  int i;
+
+  for (i = 0; i < numWorkersStarted; i++) {
+    fprintf(out, "load worker %d: conns %ld req/s %lu queue %d migrated in %lu", i,
+	   __atomic_load_n(&workerLoad[i].active, __ATOMIC_RELAXED),
+	   __atomic_load_n(&workerLoad[i].rate, __ATOMIC_RELAXED),
+	   __atomic_load_n(&workerLoad[i].queueDepth, __ATOMIC_RELAXED),
+	   __atomic_load_n(&workerLoad[i].migratedIn, __ATOMIC_RELAXED));
+    if ((q = workers[i].inbox) != NULL) {
+      fprintf(out, " inbox %lu msgs in %lu wakeups",
+	     __atomic_load_n(&q->received, __ATOMIC_RELAXED),
+	     __atomic_load_n(&q->wakeups, __ATOMIC_RELAXED));
+    }
+    if (watchdogMillis > 0) {
+      fprintf(out, " stalls %lu re-armed %lu", stallsFound[i], stallsRearmed[i]);
+    }
+    fprintf(out, "\n");
+  }
+  fflush(out);
+}
+
+void printWorkerStats(FILE *out) {
+  struct worker_stats sum, st;
+  uint64_t requests, totalRequests = 0;
+  int i;
+
+  memset(&sum, 0, sizeof sum);
+  for (i = 0; i < numWorkersStarted; i++) {
+    st.bytesIn = __atomic_load_n(&workerStats[i].bytesIn, __ATOMIC_RELAXED);
+    st.bytesOut = __atomic_load_n(&workerStats[i].bytesOut, __ATOMIC_RELAXED);
+    st.waits = __atomic_load_n(&workerStats[i].waits, __ATOMIC_RELAXED);
+    st.events = __atomic_load_n(&workerStats[i].events, __ATOMIC_RELAXED);
+    st.eagains = __atomic_load_n(&workerStats[i].eagains, __ATOMIC_RELAXED);
+    st.rearms = __atomic_load_n(&workerStats[i].rearms, __ATOMIC_RELAXED);
+    st.closes = __atomic_load_n(&workerStats[i].closes, __ATOMIC_RELAXED);
+    st.resets = __atomic_load_n(&workerStats[i].resets, __ATOMIC_RELAXED);
+    requests = __atomic_load_n(&workerLoad[i].requests, __ATOMIC_RELAXED);
+    fprintf(out, "stats worker %d: requests %lu bytes in %lu out %lu waits %lu"
+	    " events/wait %.1f eagains %lu rearms %lu closes %lu resets %lu\n",
+	    i, requests, st.bytesIn, st.bytesOut, st.waits,
+	    st.waits ? (double) st.events / st.waits : 0.0, st.eagains, st.rearms,
+	    st.closes, st.resets);
+    totalRequests += requests;
+    sum.bytesIn += st.bytesIn;
+    sum.bytesOut += st.bytesOut;
+    sum.waits += st.waits;
+    sum.events += st.events;
+    sum.eagains += st.eagains;
+    sum.rearms += st.rearms;
+    sum.closes += st.closes;
+    sum.resets += st.resets;
+  }
+  fprintf(out, "stats total: requests %lu bytes in %lu out %lu waits %lu"
+	  " events/wait %.1f eagains %lu rearms %lu closes %lu resets %lu\n",
+	  totalRequests, sum.bytesIn, sum.bytesOut, sum.waits,
+	  sum.waits ? (double) sum.events / sum.waits : 0.0, sum.eagains, sum.rearms,
+	  sum.closes, sum.resets);
+  fflush(out);
+}
+
+// Latency histograms (-L).
+//
+// Each worker times its responses from two starting points: when the
+// wait that reported the socket returned, which includes time spent
+// serving the sockets ahead of it in the batch, and when the requests
+// were read. Both end when the last byte of the responses has been
+// handed to the kernel (for io_uring, when the last linked send
+// completes). Clock reads are vDSO calls, and -L is off by default.
+
+static int histIndex(uint64_t v) {
+  int msb;
+  if (v < HIST_SUB_BUCKETS) return v;
+  msb = 63 - __builtin_clzll(v);
+  return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+    ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+// Smallest value that lands in bucket i.
+static uint64_t histValue(int i) {
+  int major = i / HIST_SUB_BUCKETS;
+  int minor = i % HIST_SUB_BUCKETS;
+  if (major == 0) return minor;
+  return (uint64_t)(HIST_SUB_BUCKETS + minor) << (major - 1);
+}
+
+void histRecord(struct histogram *h, uint64_t v) {
+  int i = histIndex(v);
+  __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+  if (v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+// dst is private to the reader; src may be being written.
+void histMerge(struct histogram *dst, struct histogram *src) {
+  uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+  }
+  if (max > dst->max) dst->max = max;
+}
+
+uint64_t histPercentile(struct histogram *h, double pct) {
+  uint64_t total = 0, seen = 0, target;
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    total += h->counts[i];
+  }
+  if (total == 0) return 0;
+  target = (uint64_t)(total * pct / 100.0);
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > target) return histValue(i);
+  }
+  return h->max;
+}
+
+// Responses just finished sending; recvAt is 0 when it was not kept for
+// them.
+void recordLatency(uint64_t waitAt, uint64_t recvAt) {
+  uint64_t now = nowNanos();
+  histRecord(&localLatency->waitToSend, now - waitAt);
+  if (recvAt != 0) histRecord(&localLatency->recvToSend, now - recvAt);
+}
+
+static void printHistogram(FILE *out, const char *who, const char *what,
+			   struct histogram *h) {
+  fprintf(out, "latency %s %s (us): p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	  who, what, histPercentile(h, 50) / 1000.0, histPercentile(h, 99) / 1000.0,
+	  histPercentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
+
+void printLatencyStats(FILE *out) {
+  struct worker_latency *all, *one, *src;
+  char who[32];
+  int i;
+
+  if (!measureLatency) return;
+  all = calloc(1, sizeof (struct worker_latency));
+  one = malloc(sizeof (struct worker_latency));
+  if (all == NULL || one == NULL) {
+    perror("latency report");
+    exit(-1);
+  }
+  for (i = 0; i < numWorkersStarted; i++) {
+    if ((src = __atomic_load_n(&workerLatency[i], __ATOMIC_ACQUIRE)) == NULL) continue;
+    memset(one, 0, sizeof (struct worker_latency));
+    histMerge(&one->waitToSend, &src->waitToSend);
+    histMerge(&one->recvToSend, &src->recvToSend);
+    snprintf(who, sizeof who, "worker %d", i);
+    printHistogram(out, who, "wait-to-send", &one->waitToSend);
+    printHistogram(out, who, "recv-to-send", &one->recvToSend);
+    histMerge(&all->waitToSend, &one->waitToSend);
+    histMerge(&all->recvToSend, &one->recvToSend);
+  }
+  printHistogram(out, "all", "wait-to-send", &all->waitToSend);
+  printHistogram(out, "all", "recv-to-send", &all->recvToSend);
+  free(all);
+  free(one);
+  fflush(out);
+}
+
+// Open fds and resident memory, which should level off under churn
+// however long the server runs. This goes through /proc/thread-self:
+// once main has exited, /proc/self names a zombie and shows neither.
+void printProcessStats(FILE *out) {
+  char line[256];
+  struct dirent *d;
+  DIR *dir;
+  FILE *f;
+  long rss = -1;
+  int fds = -1, active = 0, i;
+
+  if ((dir = opendir("/proc/thread-self/fd")) != NULL) {
+    // start at -1 for the fd opendir itself holds
+    while ((d = readdir(dir)) != NULL) {
+      if (d->d_name[0] != '.') fds++;
+    }
+    closedir(dir);
+  }
+  if ((f = fopen("/proc/thread-self/status", "r")) != NULL) {
+    while (fgets(line, sizeof line, f) != NULL) {
+      if (sscanf(line, "VmRSS: %ld", &rss) == 1) break;
+    }
+    fclose(f);
+  }
+  for (i = 0; i < numWorkersStarted; i++) {
+    active += __atomic_load_n(&workerLoad[i].active, __ATOMIC_RELAXED);
+  }
+  fprintf(out, "process: connections %d open fds %d rss %ld kB\n", active, fds, rss);
+  fflush(out);
+}
+
+void printReport(FILE *out) {
+  printProcessStats(out);
+  printWorkerStats(out);
+  if (timeoutMillis[TIMEOUT_IDLE] > 0) printTimeoutStats(out);
+  if (docRootFd >= 0) printFileStats(out);
+  if (cacheLimit > 0) printCacheStats(out);
+  if (zeroCopyMin > 0) printZeroCopyStats(out);
+  printLatencyStats(out);
+  printLoadStats(out);
+  printDispatchStats(out);
+  printPoolStats(out);
+}
+
+// -U path serves printReport on a Unix socket, one report per
+// connection ("nc -U path"), from its own thread so that asking costs
+// the workers nothing.
+void startStatsServer(const char *path) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, statsServerLoop, (void *) path)) {
+    perror("pthread_create");
+    exit(-1);
+  }
+}
+
+void *statsServerLoop(void *arg) {
+  const char *path = arg;
+  struct sockaddr_un addr;
+  FILE *out;
+  int sd, fd;
+
+  if (-1 == (sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))) {
+    perror("stats socket");
+    exit(-1);
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    printf("error: stats socket path too long\n");
+    exit(-1);
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(sd, (struct sockaddr *) &addr, sizeof addr) || listen(sd, 16)) {
+    perror("stats socket bind");
+    exit(-1);
+  }
+  while (1) {
+    if (-1 == (fd = accept4(sd, NULL, NULL, SOCK_CLOEXEC))) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+	// keep whoever asked queued, and try again once fds may be free
+	poll(NULL, 0, SHED_WAIT_MS);
+	continue;
+      }
+      perror("stats socket accept");
+      exit(-1);
+    }
+    if ((out = fdopen(fd, "w")) == NULL) {
+      close(fd);
+      continue;
+    }
+    printReport(out);
+    fclose(out);
+  }
+  pthread_exit(NULL);
+}
+
+// Worker inboxes.
+//
+// In the backends with an event set per worker, other threads never
+// touch a worker's set: accepted and migrated connections are posted to
+// the worker's inbox and it registers them itself. The inbox is a
+// bounded MPSC ring (each slot's sequence number says whether it is
+// free, being filled or ready, so producers only contend on the CAS of
+// tail) and an eventfd in the worker's set. Wakeups are coalesced: only
+// the producer that flips wakeupPending writes the eventfd, and the
+// worker clears it before draining, so a burst of messages costs one
+// wakeup and a message posted during the drain still gets its own.
+
+void initInbox(int w) {
+  struct msg_queue *q;
+  int i;
+
+  if (posix_memalign((void **) &q, 64, sizeof (struct msg_queue))) {
+    perror("inbox allocation");
+    exit(-1);
+  }
+  memset(q, 0, sizeof (struct msg_queue));
+  if (NULL == (q->slots = calloc(MSG_QUEUE_SIZE, sizeof (struct msg_slot)))) {
+    perror("inbox allocation");
+    exit(-1);
+  }
+  for (i = 0; i < MSG_QUEUE_SIZE; i++) {
+    q->slots[i].seq = i;
+  }
+  if (-1 == (q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+    perror("inbox eventfd");
+    exit(-1);
+  }
+  workers[w].inbox = q;
+}
+
+// Post a message to worker w. Returns 0 if its inbox is full.
+int sendMessage(int w, int type, int fd, uint32_t arms) {
+  struct msg_queue *q = workers[w].inbox;
+  struct msg_slot *slot;
+  uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  int64_t dif;
+
+  while (1) {
+    slot = &q->slots[pos & (MSG_QUEUE_SIZE - 1)];
+    dif = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (dif < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->msg.type = type;
+  slot->msg.fd = fd;
+  slot->msg.arms = arms;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  if (!__atomic_exchange_n(&q->wakeupPending, 1, __ATOMIC_SEQ_CST) &&
+      eventfd_write(q->efd, 1)) {
+    perror("inbox eventfd_write");
+    exit(-1);
+  }
+  return 1;
+}
+
+// Give worker w a new connection to register in its event set: through
+// its inbox if it has one, waiting for room if need be, so that only the
+// owner ever registers a connection (and files its timeout); directly
+// in the shared-set backends, which have no inboxes.
+void handOff(int sock, int w, int type) {
+  if (workers[w].inbox == NULL) {
+    registerSocket(sock, w);
+    return;
+  }
+  while (!sendMessage(w, type, sock, 0)) sched_yield();
+}
+
+// Add a connection to worker w's event set, waiting for input.
+void registerSocket(int sock, int w) {
+  struct conn *c = getConn(sock);
+  c->arms++;
+  __atomic_store_n(&c->armed, 1, __ATOMIC_RELAXED);
+  armTimeout(c, ARM_READ);
+  backend->addSocket(sock, w);
+}
+
+void drainInbox(int w) {
+  struct msg_queue *q = workers[w].inbox;
+  struct msg_slot *slot;
+  struct worker_msg msg;
+  struct conn *c;
+  eventfd_t val;
+
+  eventfd_read(q->efd, &val);
+  __atomic_store_n(&q->wakeupPending, 0, __ATOMIC_SEQ_CST);
+  q->wakeups++;
+  while (1) {
+    slot = &q->slots[q->head & (MSG_QUEUE_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1) break;
+    msg = slot->msg;
+    __atomic_store_n(&slot->seq, q->head + MSG_QUEUE_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELAXED);
+    q->received++;
+    switch (msg.type) {
+    case MSG_ACCEPTED:
+    case MSG_MIGRATED:
+      registerSocket(msg.fd, w);
+      break;
+    case MSG_REARM:
+      c = getConn(msg.fd);
+      // only if nothing has happened to the socket since the watchdog
+      // looked; re-arming makes the kernel check for input again.
+      if (c != NULL && c->owner == w && c->armed && c->arms == msg.arms) {
+	c->arms++;
+	armSocket(msg.fd, w, ARM_READ);
+      }
+      break;
+    }
+  }
+}
+
+// Connection migration (-m).
+//
+// Taking an armed socket out of another worker's set races with that
+// worker, which may already hold an event for it. So stealing is a
+// request: a worker whose last wait returned at most STEAL_IDLE_EVENTS
+// sockets raises stealRequested before it blocks, and a busy worker
+// (at least STEAL_BUSY_EVENTS ready) hands over its next connection
+// that runs dry instead of re-arming it. At that point the donor owns
+// the connection outright and nothing is queued for it, so moving it
+// is just a delete from one set and an add to the other; the add
+// reports input that arrived meanwhile, so no wakeup is lost. The new
+// owner does the add itself, from its inbox. Each
+// worker gives away at most migrateLimit connections a second, and
+// never to a worker with as many connections as itself.
+
+void requestSteal(int w) {
+  if (!__atomic_load_n(&workerLoad[w].stealRequested, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&workerLoad[w].stealRequested, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&numStealRequests, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Called by worker w with sock drained and not yet re-armed. Returns 1
+// if sock has been dealt with: handed to another worker or, when that
+// worker's inbox is full, registered again here.
+int migrateConnection(int sock, int w) {
+  struct worker_load *me = &workerLoad[w];
+  struct conn *c;
+  time_t now;
+  int one = 1;
+  int i, to;
+
+  if (__atomic_load_n(&numStealRequests, __ATOMIC_RELAXED) == 0 ||
+      me->queueDepth < STEAL_BUSY_EVENTS) {
+    return 0;
+  }
+  now = time(NULL);
+  if (now != me->migrateSecond) {
+    me->migrateSecond = now;
+    me->migrateCount = 0;
+  }
+  if (me->migrateCount >= migrateLimit) return 0;
+  for (i = 1; i < numWorkersStarted; i++) {
+    to = (w + i) % numWorkersStarted;
+    if (__atomic_load_n(&workerLoad[to].active, __ATOMIC_RELAXED) + 1 >=
+	__atomic_load_n(&me->active, __ATOMIC_RELAXED)) {
+      continue;
+    }
+    // claim the request; another donor may beat us to it.
+    if (__atomic_load_n(&workerLoad[to].stealRequested, __ATOMIC_RELAXED) &&
+	__atomic_compare_exchange_n(&workerLoad[to].stealRequested, &one, 0, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      __atomic_fetch_sub(&numStealRequests, 1, __ATOMIC_RELAXED);
+      c = getConn(sock);
+      cancelTimeout(c);
+      backend->dropSocket(sock, w);
+      __atomic_fetch_sub(&workerLoad[w].active, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&workerLoad[to].active, 1, __ATOMIC_RELAXED);
+      // the new owner may see an event as soon as it has the message.
+      __atomic_store_n(&c->owner, to, __ATOMIC_RELEASE);
+      if (!sendMessage(to, MSG_MIGRATED, sock, 0)) {
+	// its inbox is full; keep the connection after all.
+	__atomic_store_n(&c->owner, w, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&workerLoad[to].active, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&workerLoad[w].active, 1, __ATOMIC_RELAXED);
+	registerSocket(sock, w);
+	return 1;
+      }
+      __atomic_fetch_add(&workerLoad[to].migratedIn, 1, __ATOMIC_RELAXED);
+      me->migrateCount++;
+      return 1;
+    }
+    one = 1;
+  }
+  return 0;
+}
+
+int incomingCpu(int fd) {
+  int cpu;
+  socklen_t len = sizeof cpu;
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len)) return -1;
+  return cpu;
+}
+
+void countLocality(int w, int cpu) {
+  if (cpu < 0 || workerCpu[w] < 0) return;
+  if (cpu == workerCpu[w]) {
+    __atomic_fetch_add(&dispatchStats[w].cpuHits, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_add(&dispatchStats[w].cpuMisses, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void printDispatchStats(FILE *out) {
+  int i;
+
+  if (!pinWorkers) return;
+  for (i = 0; i < MAX_NUM_WORKERS && workerCpu[i] >= 0; i++) {
+    fprintf(out, "dispatch worker %d (cpu %d): hits %lu misses %lu\n", i, workerCpu[i],
+	   __atomic_load_n(&dispatchStats[i].cpuHits, __ATOMIC_RELAXED),
+	   __atomic_load_n(&dispatchStats[i].cpuMisses, __ATOMIC_RELAXED));
+  }
+  fflush(out);
+}
+
+// Connection timeouts (-T).
+//
+// A worker files each connection waiting in its event set on its timer
+// wheel and bounds its wait by the wheel's next tick, so expiring is
+// O(1) per connection and a tick only looks at one slot, however many
+// idle connections there are. Pushing a deadline back, which every
+// re-arm of a busy keep-alive connection does, just stores it: the
+// connection is re-filed when the slot it is on comes up. A connection
+// out of time is shut down rather than closed, so that the event that
+// follows takes it through the usual close path; io_uring also cancels
+// what it has in flight for the socket. Only a connection's owner
+// touches it and its wheel, which is why the shared-set backends,
+// where any worker may get any socket, cannot use -T.
+
+static void timerFile(struct timer_wheel *tw, struct conn *c, uint64_t tick) {
+  struct conn **slot = &tw->slots[tick & (TIMER_SLOTS - 1)];
+
+  c->timerTick = tick;
+  c->timerNext = *slot;
+  if (*slot != NULL) (*slot)->timerPrev = &c->timerNext;
+  c->timerPrev = slot;
+  *slot = c;
+  tw->count++;
+}
+
+static void timerUnfile(struct timer_wheel *tw, struct conn *c) {
+  *c->timerPrev = c->timerNext;
+  if (c->timerNext != NULL) c->timerNext->timerPrev = c->timerPrev;
+  c->timerPrev = NULL;
+  tw->count--;
+}
+
+// c is about to wait for ARM_READ or ARM_WRITE; give it the timeout for
+// what it waits for. A request has requestTimeout from when it started
+// (or the connection was accepted) however slowly it trickles in.
+void armTimeout(struct conn *c, int events) {
+  struct timer_wheel *tw = localWheel;
+  uint64_t tick;
+  int kind;
+
+  if (tw == NULL) return;
+  if (events == ARM_WRITE) {
+    kind = TIMEOUT_WRITE;
+  } else if (c->requests == 0 || c->parser.headerLen > 0 || c->parser.bodyRemaining > 0) {
+    kind = TIMEOUT_REQUEST;
+    if (c->timerPrev != NULL && c->timerKind == kind &&
+	c->timerRequests == c->requests) return;
+  } else {
+    kind = TIMEOUT_IDLE;
+  }
+  c->timerKind = kind;
+  c->timerRequests = c->requests;
+  c->deadline = tw->now + timeoutMillis[kind];
+  tick = (c->deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  if (tick < tw->tick) tick = tw->tick;
+  if (c->timerPrev != NULL) {
+    if (c->timerTick <= tick) return;
+    timerUnfile(tw, c);
+  }
+  timerFile(tw, c, tick);
+}
+
+// Take c off the calling worker's wheel: it is closing or moving.
+void cancelTimeout(struct conn *c) {
+  if (c->timerPrev != NULL) timerUnfile(localWheel, c);
+}
+
+// How long the calling worker may wait for events, in the convention
+// of epoll_wait: until its next tick, or for ever with nothing filed.
+// Like expireTimeouts it goes by when the last wait returned, which
+// saves reading the clock again at the cost of a late tick now and
+// then, by the time a batch takes.
+int nextTimeout(void) {
+  struct timer_wheel *tw = localWheel;
+  uint64_t due;
+
+  if (tw == NULL || tw->count == 0) return -1;
+  due = tw->tick * TIMER_TICK_MS;
+  return due > tw->now ? due - tw->now : 0;
+}
+
+// Run worker w's wheel up to now: shut down the connections in the due
+// slots whose deadline has passed and re-file the others.
+void expireTimeouts(int w) {
+  struct timer_wheel *tw = localWheel;
+  struct conn *c, *next;
+  uint64_t now = tw->now;
+  uint64_t last = now / TIMER_TICK_MS;
+
+  // more than a turn behind: visiting every slot once is enough.
+  if (tw->tick + TIMER_SLOTS <= last) tw->tick = last - TIMER_SLOTS + 1;
+  for (; tw->tick <= last; tw->tick++) {
+    for (c = tw->slots[tw->tick & (TIMER_SLOTS - 1)]; c != NULL; c = next) {
+      next = c->timerNext;
+      if (c->timerTick > tw->tick) continue; // due on a later turn
+      timerUnfile(tw, c);
+      if (c->deadline > now) {
+	timerFile(tw, c, (c->deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+	continue;
+      }
+      STAT_ADD(w, timeouts[(int) c->timerKind], 1);
+      shutdown(c->fd, SHUT_RDWR);
+      if (localRing != NULL) uringCancel(localRing, c->fd);
+    }
+  }
+}
+
+void printTimeoutStats(FILE *out) {
+  uint64_t t[3], sum[3] = { 0, 0, 0 };
+  int i, k;
+
+  for (i = 0; i < numWorkersStarted; i++) {
+    for (k = 0; k < 3; k++) {
+      t[k] = __atomic_load_n(&workerStats[i].timeouts[k], __ATOMIC_RELAXED);
+      sum[k] += t[k];
+    }
+    fprintf(out, "timeouts worker %d: idle %lu request %lu write %lu\n",
+	    i, t[TIMEOUT_IDLE], t[TIMEOUT_REQUEST], t[TIMEOUT_WRITE]);
+  }
+  fprintf(out, "timeouts total: idle %lu request %lu write %lu\n",
+	  sum[TIMEOUT_IDLE], sum[TIMEOUT_REQUEST], sum[TIMEOUT_WRITE]);
+  fflush(out);
+}
+
+// Response templates.
+//
+// A template is a complete response rendered once at startup, with its
+// Content-Length computed from the body. Only the Date line changes
+// afterwards: dateLoop rewrites it once a second into the spare of two
+// copies and then flips current, so workers only ever load a pointer.
+// A copy is rewritten a second after it stopped being current, by which
+// time every writev that picked it up has long returned. (An io_uring
+// send parked in the kernel for longer than that may carry a torn Date.)
+
+void buildTemplate(struct response_template *t, const char *status,
+		   const char *headers, const char *body) {
+  size_t bodyLen = strlen(body);
+  int b, i, n;
+
+  n = snprintf(NULL, 0, "HTTP/1.1 %s\r\nDate: %*s\r\nContent-Length: %zu\r\n%s\r\n",
+	       status, DATE_LEN, "", bodyLen, headers);
+  t->len = n + bodyLen;
+  t->headerLen = n;
+  if (t->len > BUF_SIZE) {
+    printf("error: response template larger than %d bytes\n", BUF_SIZE);
+    exit(-1);
+  }
+  t->dateOffset = strlen("HTTP/1.1 ") + strlen(status) + strlen("\r\nDate: ");
+  for (b = 0; b < 2; b++) {
+    t->buf[b] = malloc(t->len + 1);
+    t->iov[b] = malloc(MAX_IOVECS * sizeof (struct iovec));
+    if (t->buf[b] == NULL || t->iov[b] == NULL) {
+      perror("malloc template");
+      exit(-1);
+    }
+    snprintf(t->buf[b], n + 1, "HTTP/1.1 %s\r\nDate: %*s\r\nContent-Length: %zu\r\n%s\r\n",
+	     status, DATE_LEN, "", bodyLen, headers);
+    memcpy(t->buf[b] + n, body, bodyLen);
+    for (i = 0; i < MAX_IOVECS; i++) {
+      t->iov[b][i].iov_base = t->buf[b];
+      t->iov[b][i].iov_len = t->len;
+    }
+  }
+  t->current = 0;
+  templates[numTemplates++] = t;
+}
+
+static void formatDate(char *dst, time_t now) {
+  struct tm tm;
+  char date[DATE_LEN + 1];
+  gmtime_r(&now, &tm);
+  strftime(date, sizeof date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  memcpy(dst, date, DATE_LEN);
+}
+
+// Stamp the current time into the spare copy of every template, then
+// make it current.
+void refreshDate(void) {
+  struct timespec ts;
+  time_t now;
+  int i, spare;
+
+  // not time(), which may still say the last second just after dateLoop
+  // wakes for the next
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now = ts.tv_sec;
+  for (i = 0; i < numTemplates; i++) {
+    spare = !templates[i]->current;
+    formatDate(templates[i]->buf[spare] + templates[i]->dateOffset, now);
+    __atomic_store_n(&templates[i]->current, spare, __ATOMIC_RELEASE);
+  }
+  if (cacheLimit > 0) stampResponses(now);
+  __atomic_store_n(&dateNow, now, __ATOMIC_RELEASE);
+}
+
+void *dateLoop(void *arg) {
+  struct timespec ts;
+  while (1) {
+    // wake just after the next second boundary
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec = 0;
+    ts.tv_nsec = 1000000000L - ts.tv_nsec;
+    nanosleep(&ts, NULL);
+    refreshDate();
+    // the same tick drives the dispatch policies' requests/sec.
+    sampleLoad();
+  }
+  pthread_exit(NULL);
+}
+
+void startDateThread(void) {
+  pthread_t thread;
+  // both copies start out with today's date
+  refreshDate();
+  refreshDate();
+  if (pthread_create(&thread, NULL, dateLoop, NULL)) {
+    perror("pthread_create");
+    exit(-1);
+  }
+}
+
+// Static files (-D).
+//
+// With -D a request names a file under the document root. Each worker
+// keeps the files it serves open in an LRU cache together with their
+// size and rendered header block, so a hit costs no open or stat: an
+// entry is checked against its path at most once a second (one fstatat)
+// and re-opened if the file was replaced or changed. The header block
+// goes out with MSG_MORE, so that it shares a segment with the start of
+// the body, and the body straight from the cached fd with sendfile,
+// never passing through user space. Pipelined requests queue their
+// responses on the connection in order, errors among them as templates.
+// An entry's Date is restamped when a request finds it a second old,
+// so, as with a template parked in an io_uring send, a header block cut
+// short by a full socket may go out with a torn Date.
+
+static uint32_t hashPath(const char *path, int len) {
+  uint32_t h = 2166136261u; // FNV-1a
+  int i;
+  for (i = 0; i < len; i++) h = (h ^ (unsigned char) path[i]) * 16777619u;
+  return h;
+}
+
+static const char *contentType(const char *path, int len) {
+  static const char *types[][2] = {
+    { ".html", "text/html" }, { ".htm", "text/html" }, { ".css", "text/css" },
+    { ".js", "application/javascript" }, { ".json", "application/json" },
+    { ".txt", "text/plain" }, { ".xml", "application/xml" },
+    { ".svg", "image/svg+xml" }, { ".png", "image/png" }, { ".jpg", "image/jpeg" },
+    { ".jpeg", "image/jpeg" }, { ".gif", "image/gif" }, { ".ico", "image/x-icon" },
+    { ".webp", "image/webp" }, { ".pdf", "application/pdf" },
+    { ".wasm", "application/wasm" },
+  };
+  unsigned i;
+  int n;
+  for (i = 0; i < sizeof types / sizeof types[0]; i++) {
+    n = strlen(types[i][0]);
+    if (len > n && !strcasecmp(path + len - n, types[i][0])) return types[i][1];
+  }
+  return "application/octet-stream";
+}
+
+static int hexValue(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  ch |= 0x20;
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  return -1;
+}
+
+// Decode the target of the request line in the header block [start,
+// start + len) into path (FILE_PATH_MAX bytes), relative to the document
+// root and with index.html for a directory. Returns NULL, or the
+// template to answer with instead.
+static struct response_template *requestPath(char *start, int len, char *path,
+					     int *pathLen, int *head) {
+  char *end = start + len;
+  char *s;
+  char ch;
+  int n = 0, i, j, hi, lo;
+
+  *head = 0;
+  if (len > 4 && !memcmp(start, "GET ", 4)) {
+    s = start + 4;
+  } else if (len > 5 && !memcmp(start, "HEAD ", 5)) {
+    s = start + 5;
+    *head = 1;
+  } else {
+    return &NOT_ALLOWED;
+  }
+  if (*s++ != '/') return &BAD_REQUEST;
+  while (s < end && *s != ' ' && *s != '?' && *s != '#' && *s != '\r' && *s != '\n') {
+    ch = *s++;
+    if (ch == '%') {
+      if (end - s < 2 || (hi = hexValue(s[0])) < 0 || (lo = hexValue(s[1])) < 0) {
+	return &BAD_REQUEST;
+      }
+      ch = hi << 4 | lo;
+      s += 2;
+    }
+    if (ch == '\0' || n >= FILE_PATH_MAX - (int) sizeof "index.html") return &BAD_REQUEST;
+    path[n++] = ch;
+  }
+  // no empty segment (which could make the path absolute) and no way up
+  for (i = 0; i < n; i = j + 1) {
+    for (j = i; j < n && path[j] != '/'; j++);
+    if (j == i || (j - i == 2 && path[i] == '.' && path[i + 1] == '.')) return &BAD_REQUEST;
+  }
+  if (n == 0 || path[n - 1] == '/') {
+    memcpy(path + n, "index.html", sizeof "index.html");
+    n += strlen("index.html");
+  }
+  path[n] = '\0';
+  *pathLen = n;
+  return NULL;
+}
+
+// Open path beneath the document root and make an entry for it, or
+// return NULL with *err set to the template to answer with, or to NULL
+// if path is a directory.
+static struct file_entry *openFile(char *path, int pathLen,
+				   struct response_template **err) {
+  struct open_how how;
+  struct file_entry *e;
+  struct stat st;
+  char lastModified[DATE_LEN + 1];
+  int fd;
+
+  // O_NONBLOCK, so that opening a FIFO someone left there cannot block us
+  memset(&how, 0, sizeof how);
+  how.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+  fd = syscall(__NR_openat2, docRootFd, path, &how, sizeof how);
+  if (fd == -1 && errno == ENOSYS) {
+    // before Linux 5.6 symlinks may lead out, but requestPath refused ".."
+    fd = openat(docRootFd, path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  }
+  if (fd == -1) {
+    *err = (errno == EMFILE || errno == ENFILE) ? &UNAVAILABLE : &NOT_FOUND;
+    return NULL;
+  }
+  if (fstat(fd, &st)) st.st_mode = 0;
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    *err = S_ISDIR(st.st_mode) ? NULL : &NOT_FOUND;
+    return NULL;
+  }
+  if (NULL == (e = malloc(sizeof *e + pathLen + 1))) {
+    perror("malloc file entry");
+    exit(-1);
+  }
+  e->refs = 1;
+  e->fd = fd;
+  e->size = st.st_size;
+  e->dev = st.st_dev;
+  e->ino = st.st_ino;
+  e->mtime = st.st_mtim;
+  e->stampedAt = 0;
+  e->uncacheable = 0;
+  e->refusedAt = 0;
+  formatDate(lastModified, st.st_mtime);
+  lastModified[DATE_LEN] = '\0';
+  e->headerLen = snprintf(e->header, FILE_HEADER_MAX,
+			  "HTTP/1.1 200 OK\r\nDate: %*s\r\nContent-Length: %lld\r\n"
+			  "Server: Mighttpd/2.8.1\r\nLast-Modified: %s\r\n"
+			  "Content-Type: %s\r\n\r\n", DATE_LEN, "", (long long) st.st_size,
+			  lastModified, contentType(path, pathLen));
+  e->pathLen = pathLen;
+  memcpy(e->path, path, pathLen + 1);
+  return e;
+}
+
+static void lruUnlink(struct file_cache *fc, struct file_entry *e) {
+  if (e->newer != NULL) e->newer->older = e->older; else fc->newest = e->older;
+  if (e->older != NULL) e->older->newer = e->newer; else fc->oldest = e->newer;
+}
+
+static void lruPush(struct file_cache *fc, struct file_entry *e) {
+  e->newer = NULL;
+  e->older = fc->newest;
+  if (fc->newest != NULL) fc->newest->newer = e; else fc->oldest = e;
+  fc->newest = e;
+}
+
+// Drop e from the cache; it is freed once no response holds it.
+static void evictFile(struct file_cache *fc, struct file_entry *e) {
+  struct file_entry **p = &fc->buckets[e->hash & (FILE_CACHE_BUCKETS - 1)];
+
+  while (*p != e) p = &(*p)->hashNext;
+  *p = e->hashNext;
+  lruUnlink(fc, e);
+  __atomic_store_n(&fc->count, fc->count - 1, __ATOMIC_RELAXED);
+  releaseFile(e);
+}
+
+// Worker w's entry for path, opened and cached if need be, or NULL with
+// *err set to the template to answer with instead. A directory named
+// without its trailing slash is served like the slash form: its
+// index.html is appended to path (FILE_PATH_MAX bytes) and *pathLen.
+struct file_entry *lookupFile(int w, char *path, int *pathLen,
+			      struct response_template **err) {
+  struct file_cache *fc = localFiles;
+  struct file_entry *e, **bucket;
+  struct stat st;
+  uint32_t hash = hashPath(path, *pathLen);
+  time_t now = __atomic_load_n(&dateNow, __ATOMIC_ACQUIRE);
+  int b;
+
+  bucket = &fc->buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+  for (e = *bucket; e != NULL; e = e->hashNext) {
+    if (e->hash == hash && e->pathLen == *pathLen && !memcmp(e->path, path, *pathLen)) break;
+  }
+  if (e != NULL && e->checkedAt != now) {
+    // still the file we have open, as it was?
+    if (fstatat(docRootFd, path, &st, 0) || st.st_dev != e->dev || st.st_ino != e->ino ||
+	st.st_size != e->size || st.st_mtim.tv_sec != e->mtime.tv_sec ||
+	st.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+      evictFile(fc, e);
+      e = NULL;
+    } else {
+      e->checkedAt = now;
+    }
+  }
+  if (e == NULL) {
+    STAT_ADD(w, fileMisses, 1);
+    if (NULL == (e = openFile(path, *pathLen, err))) {
+      if (*err != NULL) return NULL;
+      if (*pathLen + (int) sizeof "/index.html" > FILE_PATH_MAX) {
+	*err = &NOT_FOUND;
+	return NULL;
+      }
+      memcpy(path + *pathLen, "/index.html", sizeof "/index.html");
+      *pathLen += strlen("/index.html");
+      return lookupFile(w, path, pathLen, err);
+    }
+    e->hash = hash;
+    e->checkedAt = now;
+    e->hashNext = *bucket;
+    *bucket = e;
+    lruPush(fc, e);
+    __atomic_store_n(&fc->count, fc->count + 1, __ATOMIC_RELAXED);
+    if (fc->count > FILE_CACHE_SIZE) evictFile(fc, fc->oldest);
+  } else {
+    STAT_ADD(w, fileHits, 1);
+    if (fc->newest != e) {
+      lruUnlink(fc, e);
+      lruPush(fc, e);
+    }
+  }
+  if (e->stampedAt != now) {
+    b = __atomic_load_n(&RESPONSE.current, __ATOMIC_ACQUIRE);
+    memcpy(e->header + FILE_DATE_OFFSET, RESPONSE.buf[b] + RESPONSE.dateOffset, DATE_LEN);
+    e->stampedAt = now;
+  }
+  return e;
+}
+
+void releaseFile(struct file_entry *e) {
+  // responses queued by a shared backend may be sent by another worker
+  if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    close(e->fd);
+    free(e);
+  }
+}
+
+// Queue the response to req on c, from worker w, or a 400 if req is NULL
+// (a request that could not be framed). Returns 0 if c owes as many
+// different responses as its queue holds: a client pipelining that far
+// ahead without reading is dropped.
+int queueFile(struct conn *c, int w, struct http_request *req) {
+  char path[FILE_PATH_MAX];
+  struct response_template *t;
+  struct file_entry *e = NULL;
+  struct cached_response *r = NULL;
+  struct file_queue *q = c->files;
+  struct file_send *s;
+  off_t len;
+  int pathLen, head = 0, i;
+
+  if (req == NULL) {
+    t = &BAD_REQUEST;
+  } else {
+    t = requestPath(req->start, req->headerLen, path, &pathLen, &head);
+  }
+  if (t == NULL && cacheLimit > 0) {
+    r = lookupResponse(path, pathLen);
+    STAT_ADD(w, cacheHits, r != NULL);
+    STAT_ADD(w, cacheMisses, r == NULL);
+  }
+  for (i = 0; t == NULL && r == NULL && i < 2; i++) {
+    e = lookupFile(w, path, &pathLen, &t);
+    if (e == NULL || cacheLimit == 0 || e->size > cacheLimit || e->uncacheable) break;
+    if ((r = cacheResponse(e, path, pathLen)) != NULL) {
+      e = NULL;
+    } else if (e->checkedAt != 0) {
+      break;
+    }
+    // else e was out of date, see cacheResponse: once more
+  }
+  if (r != NULL) t = &r->t;
+  if (e != NULL) {
+    len = e->headerLen + (head ? 0 : e->size);
+  } else {
+    len = head ? t->headerLen : t->len;
+  }
+  if (q == NULL) {
+    q = c->files = bufAlloc();
+    q->head = 0;
+    q->count = 0;
+  }
+  if (q->count > 0) {
+    // the same again, as a pipelining benchmark asks for
+    s = &q->items[(q->head + q->count - 1) % FILE_QUEUE_LEN];
+    if (s->file == e && s->t == t && s->len == len) {
+      s->count++;
+      return 1;
+    }
+  }
+  if (q->count == FILE_QUEUE_LEN) return 0;
+  s = &q->items[(q->head + q->count) % FILE_QUEUE_LEN];
+  q->count++;
+  s->file = e;
+  s->t = t;
+  s->cached = r;
+  s->counted = 0;
+  s->len = len;
+  s->pos = 0;
+  s->count = 1;
+  if (e != NULL) __atomic_fetch_add(&e->refs, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+// Write as much of what c->files owes as the socket takes, and free the
+// queue once it is empty. Repeats of a template or cached response go
+// out up to MAX_IOVECS to a sendmsg, as flushOutput does with RESPONSE,
+// except that with -Z a cached response whose body is large enough goes
+// out like a file: its header by copy and its body by sendZeroCopy.
+// Returns what flushOutput does.
+int flushFiles(int sock, int w) {
+  struct conn *c = getConn(sock);
+  struct file_queue *q = c->files;
+  struct file_send *s;
+  struct iovec iov[MAX_IOVECS];
+  struct msghdr msg;
+  char *base;
+  off_t off;
+  ssize_t n;
+  int i, k, more, zeroCopy;
+
+  while (q->count > 0) {
+    s = &q->items[q->head];
+    zeroCopy = s->cached != NULL && zeroCopyMin > 0 &&
+      s->len - (off_t) s->t->headerLen >= zeroCopyMin;
+    if (s->file == NULL && !zeroCopy) {
+      base = s->t->buf[__atomic_load_n(&s->t->current, __ATOMIC_ACQUIRE)];
+      k = s->count < MAX_IOVECS ? s->count : MAX_IOVECS;
+      iov[0].iov_base = base + s->pos;
+      iov[0].iov_len = s->len - s->pos;
+      for (i = 1; i < k; i++) {
+	iov[i].iov_base = base;
+	iov[i].iov_len = s->len;
+      }
+      memset(&msg, 0, sizeof msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = k;
+      more = s->count > k || q->count > 1;
+      n = sendmsg(sock, &msg, more ? MSG_MORE : 0);
+    } else if (s->file != NULL && s->pos < s->file->headerLen) {
+      // hold the segment open for the body, or whatever follows
+      more = s->len > s->file->headerLen || s->count > 1 || q->count > 1;
+      n = send(sock, s->file->header + s->pos, s->file->headerLen - s->pos,
+	       more ? MSG_MORE : 0);
+    } else if (s->file != NULL) {
+      off = s->pos - s->file->headerLen;
+      n = sendfile(sock, s->file->fd, &off, s->len - s->pos);
+      // the file shrank since it was cached: the response cannot be
+      // finished, and neither can the connection.
+      if (n == 0) return -1;
+    } else if (s->pos < (off_t) s->t->headerLen) {
+      // copied, since its Date gets restamped; the body never changes
+      base = s->t->buf[__atomic_load_n(&s->t->current, __ATOMIC_ACQUIRE)];
+      n = send(sock, base + s->pos, s->t->headerLen - s->pos, MSG_MORE);
+    } else {
+      n = sendZeroCopy(sock, w, s, s->count > 1 || q->count > 1);
+    }
+    if (n == -1) {
+      if (errno == EAGAIN) {
+	STAT_ADD(w, eagains, 1);
+	// what is left outlives this batch, see reclaimResponses.
+	for (i = 0; i < q->count; i++) {
+	  s = &q->items[(q->head + i) % FILE_QUEUE_LEN];
+	  if (s->cached != NULL && !s->counted) {
+	    __atomic_fetch_add(&s->cached->refs, 1, __ATOMIC_RELAXED);
+	    s->counted = 1;
+	  }
+	}
+	return 0;
+      }
+      if (errno == EINTR) continue;
+      // EPIPE, ECONNRESET, ETIMEDOUT and the like: the connection is gone.
+      STAT_ADD(w, resets, 1);
+      return -1;
+    }
+    STAT_ADD(w, bytesOut, n);
+    s->pos += n;
+    while (s->pos >= s->len && s->count > 0) {
+      s->pos -= s->len;
+      s->count--;
+    }
+    if (s->count > 0) continue;
+    if (s->file != NULL) releaseFile(s->file);
+    if (s->counted) releaseResponse(s->cached);
+    q->head = (q->head + 1) % FILE_QUEUE_LEN;
+    q->count--;
+  }
+  poolFree(q);
+  c->files = NULL;
+  return 1;
+}
+
+// What a closing connection still owed.
+void freeFileQueue(struct file_queue *q) {
+  struct file_send *s;
+  int i;
+  for (i = 0; i < q->count; i++) {
+    s = &q->items[(q->head + i) % FILE_QUEUE_LEN];
+    if (s->file != NULL) releaseFile(s->file);
+    if (s->counted) releaseResponse(s->cached);
+  }
+  poolFree(q);
+}
+
+void printFileStats(FILE *out) {
+  struct file_cache *fc;
+  uint64_t hits, misses, sumHits = 0, sumMisses = 0;
+  int i, cached, sumCached = 0;
+
+  for (i = 0; i < numWorkersStarted; i++) {
+    fc = __atomic_load_n(&fileCaches[i], __ATOMIC_ACQUIRE);
+    cached = fc != NULL ? __atomic_load_n(&fc->count, __ATOMIC_RELAXED) : 0;
+    hits = __atomic_load_n(&workerStats[i].fileHits, __ATOMIC_RELAXED);
+    misses = __atomic_load_n(&workerStats[i].fileMisses, __ATOMIC_RELAXED);
+    fprintf(out, "files worker %d: cached %d hits %lu misses %lu\n", i, cached, hits, misses);
+    sumCached += cached;
+    sumHits += hits;
+    sumMisses += misses;
+  }
+  fprintf(out, "files total: cached %d hits %lu misses %lu hit rate %.1f%%\n",
+	  sumCached, sumHits, sumMisses,
+	  sumHits + sumMisses ? 100.0 * sumHits / (sumHits + sumMisses) : 0.0);
+  fflush(out);
+}
+
+// Response cache (-C).
+//
+// Files up to -C bytes are also kept as complete responses, headers and
+// body in one mapping, so that a hit is a single send of a precomputed
+// buffer like RESPONSE, with no file system access at all. The cache is
+// one hash table shared by all workers. Readers take no lock and write
+// nothing shared: a worker is between two waits while it uses what it
+// found, and a response that is unlinked (cacheLock serializes writers)
+// is only freed once every worker has been through a wait since, which
+// cacheOffline and cacheOnline record (quiescent-state based RCU). The
+// rare response still queued on a full socket when its worker waits is
+// counted instead. Entries are not revalidated: the cache thread watches
+// every directory on the way to a cached file with inotify, drops the
+// entries named in each event (by file name, in whatever directory) and
+// everything on a change to a directory, and frees what it has retired.
+// Mappings are counted against CACHE_BYTES from before a response is
+// made until it is freed; a miss that finds no room evicts by the clock
+// instead, and its file is not tried again until something is freed.
+// Like templates, cached responses are double-buffered for their Date,
+// which refreshDate restamps through stampResponses.
+
+static int watchPath(char *path, int pathLen) {
+  char dir[PATH_MAX];
+  int i;
+
+  // the document root, then each directory below it on the way
+  for (i = 0; i < pathLen; i++) {
+    if (i > 0 && path[i] != '/') continue;
+    if (snprintf(dir, sizeof dir, "%s/%.*s", docRoot, i, path) >= (int) sizeof dir) return 0;
+    if (-1 == inotify_add_watch(inotifyFd, dir, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+				IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE |
+				IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Unlink r, which *p points to, from its hash chain and from the clock,
+// and retire it. Called with cacheLock held.
+static void retireResponse(struct cached_response **p, struct cached_response *r) {
+  // readers still on r go on through r->next, which stays put.
+  __atomic_store_n(p, r->next, __ATOMIC_RELEASE);
+  if (r->clockNext == r) {
+    cacheHand = NULL;
+  } else {
+    r->clockPrev->clockNext = r->clockNext;
+    r->clockNext->clockPrev = r->clockPrev;
+    if (cacheHand == r) cacheHand = r->clockNext;
+  }
+  r->retiredEpoch = __atomic_add_fetch(&cacheEpoch, 1, __ATOMIC_SEQ_CST);
+  r->retired = cacheRetired;
+  cacheRetired = r;
+  cacheRetiredBytes += r->mapLen;
+  __atomic_store_n(&cacheEntries, cacheEntries - 1, __ATOMIC_RELAXED);
+}
+
+// Go round the clock, retiring responses not hit since the hand last
+// came by, until what stays cached leaves room for need more bytes once
+// reclaimResponses has freed the rest. Called with cacheLock held.
+static void evictResponses(long need) {
+  struct cached_response **p, *r;
+
+  while ((r = cacheHand) != NULL && cacheBytes - cacheRetiredBytes + need > CACHE_BYTES) {
+    cacheHand = r->clockNext;
+    if (r->referenced) {
+      __atomic_store_n(&r->referenced, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    for (p = &cacheBuckets[r->hash & (CACHE_BUCKETS - 1)]; *p != r; p = &(*p)->next);
+    retireResponse(p, r);
+    __atomic_store_n(&cacheEvictions, cacheEvictions + 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Count mapLen bytes against CACHE_BYTES for a response about to be
+// made. If they do not fit, evict to make room for next time instead,
+// and return 0.
+static int reserveResponse(long mapLen) {
+  int fits;
+
+  pthread_mutex_lock(&cacheLock);
+  if ((fits = cacheBytes + mapLen <= CACHE_BYTES)) {
+    __atomic_store_n(&cacheBytes, cacheBytes + mapLen, __ATOMIC_RELAXED);
+  } else {
+    evictResponses(mapLen);
+  }
+  pthread_mutex_unlock(&cacheLock);
+  return fits;
+}
+
+// Give back what reserveResponse counted, for a response not cached
+// after all. Called with cacheLock held.
+static void unreserveResponse(long mapLen) {
+  __atomic_store_n(&cacheBytes, cacheBytes - mapLen, __ATOMIC_RELAXED);
+  __atomic_store_n(&cacheRoom, cacheRoom + 1, __ATOMIC_RELEASE);
+}
+
+// The cached response for path, or NULL. The caller must be online.
+struct cached_response *lookupResponse(char *path, int pathLen) {
+  struct cached_response *r;
+  uint32_t hash = hashPath(path, pathLen);
+
+  for (r = __atomic_load_n(&cacheBuckets[hash & (CACHE_BUCKETS - 1)], __ATOMIC_ACQUIRE);
+       r != NULL; r = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE)) {
+    if (r->hash == hash && r->pathLen == pathLen && !memcmp(r->path, path, pathLen)) break;
+  }
+  // for the clock; most hits only read the line
+  if (r != NULL && !__atomic_load_n(&r->referenced, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&r->referenced, 1, __ATOMIC_RELAXED);
+  }
+  return r;
+}
+
+// Make a complete response of e, which lookupFile has just found for
+// path, and publish it, unless another worker beat us to it. Returns
+// NULL if it cannot be cached, for now or for good (a symlink, whose
+// target's changes we would not see, or a response bigger than the
+// whole cache). If the cache is full, e is not tried again until
+// something has been freed. If path no longer matches e, or cannot be
+// watched, e is marked as never checked, so that lookupFile checks it
+// next time.
+struct cached_response *cacheResponse(struct file_entry *e, char *path, int pathLen) {
+  static long pageSize;
+  struct cached_response *r, *old, **bucket;
+  struct stat st;
+  uint64_t gen, room;
+  size_t len = e->headerLen + e->size, mapLen;
+  char *map = NULL;
+
+  // room first, so that a full cache costs a miss no system calls
+  room = __atomic_load_n(&cacheRoom, __ATOMIC_ACQUIRE);
+  if (e->refusedAt == room) return NULL;
+  if (pageSize == 0) pageSize = sysconf(_SC_PAGESIZE);
+  mapLen = (2 * len + pageSize - 1) & ~(pageSize - 1);
+  if (mapLen > CACHE_BYTES) {
+    e->uncacheable = 1;
+    return NULL;
+  }
+  if (!reserveResponse(mapLen)) {
+    e->refusedAt = room;
+    return NULL;
+  }
+  // watch first: whatever changes after this is seen by the cache thread
+  if (!watchPath(path, pathLen)) {
+    e->checkedAt = 0; // most likely a directory on the way is gone
+    goto unreserve;
+  }
+  gen = __atomic_load_n(&cacheGeneration, __ATOMIC_ACQUIRE);
+  if (fstatat(docRootFd, path, &st, AT_SYMLINK_NOFOLLOW)) {
+    e->checkedAt = 0;
+    goto unreserve;
+  }
+  if (S_ISLNK(st.st_mode)) {
+    e->uncacheable = 1;
+    goto unreserve;
+  }
+  if (st.st_dev != e->dev || st.st_ino != e->ino || st.st_size != e->size ||
+      st.st_mtim.tv_sec != e->mtime.tv_sec || st.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+    e->checkedAt = 0;
+    goto unreserve;
+  }
+  map = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+	     -1, 0);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    goto unreserve;
+  }
+  memcpy(map, e->header, e->headerLen);
+  if (pread(e->fd, map + e->headerLen, e->size, 0) != e->size) goto unreserve;
+  memcpy(map + len, map, len);
+  if (NULL == (r = malloc(sizeof *r + pathLen + 1))) {
+    perror("malloc cached response");
+    exit(-1);
+  }
+  memset(&r->t, 0, sizeof r->t);
+  r->t.buf[0] = map;
+  r->t.buf[1] = map + len;
+  r->t.len = len;
+  r->t.headerLen = e->headerLen;
+  r->t.dateOffset = FILE_DATE_OFFSET;
+  r->referenced = 0;
+  r->mapLen = mapLen;
+  r->refs = 0;
+  r->hash = hashPath(path, pathLen);
+  r->pathLen = pathLen;
+  memcpy(r->path, path, pathLen + 1);
+
+  pthread_mutex_lock(&cacheLock);
+  bucket = &cacheBuckets[r->hash & (CACHE_BUCKETS - 1)];
+  for (old = *bucket; old != NULL; old = old->next) {
+    if (old->hash == r->hash && old->pathLen == pathLen && !memcmp(old->path, path, pathLen)) {
+      break;
+    }
+  }
+  // an event since gen may be about the copy we just read
+  if (old == NULL && gen == cacheGeneration) {
+    // just behind the hand: the last the clock comes to
+    if (cacheHand == NULL) {
+      r->clockNext = r->clockPrev = r;
+      cacheHand = r;
+    } else {
+      r->clockNext = cacheHand;
+      r->clockPrev = cacheHand->clockPrev;
+      r->clockPrev->clockNext = r;
+      cacheHand->clockPrev = r;
+    }
+    r->next = *bucket;
+    __atomic_store_n(bucket, r, __ATOMIC_RELEASE);
+    __atomic_store_n(&cacheEntries, cacheEntries + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cacheLock);
+    return r;
+  }
+  unreserveResponse(mapLen);
+  pthread_mutex_unlock(&cacheLock);
+  munmap(map, mapLen);
+  free(r);
+  return old;
+
+ unreserve:
+  pthread_mutex_lock(&cacheLock);
+  unreserveResponse(mapLen);
+  pthread_mutex_unlock(&cacheLock);
+  if (map != NULL) munmap(map, mapLen);
+  return NULL;
+}
+
+void releaseResponse(struct cached_response *r) {
+  __atomic_fetch_sub(&r->refs, 1, __ATOMIC_RELEASE);
+}
+
+// Give every cached response the Date of now, like refreshDate does
+// for the templates.
+void stampResponses(time_t now) {
+  struct cached_response *r;
+  char date[DATE_LEN];
+  int i, spare;
+
+  formatDate(date, now);
+  pthread_mutex_lock(&cacheLock);
+  for (i = 0; i < CACHE_BUCKETS; i++) {
+    for (r = cacheBuckets[i]; r != NULL; r = r->next) {
+      spare = !r->t.current;
+      memcpy(r->t.buf[spare] + FILE_DATE_OFFSET, date, DATE_LEN);
+      __atomic_store_n(&r->t.current, spare, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+// Unlink the cached responses for files called name, or all of them if
+// name is NULL, and retire them. Called with cacheLock held.
+void invalidateResponses(char *name, int nameLen) {
+  struct cached_response **p, *r;
+  char *base;
+  int i;
+
+  for (i = 0; i < CACHE_BUCKETS; i++) {
+    for (p = &cacheBuckets[i]; (r = *p) != NULL; ) {
+      base = strrchr(r->path, '/');
+      base = base != NULL ? base + 1 : r->path;
+      if (name != NULL && (r->path + r->pathLen - base != nameLen || memcmp(base, name, nameLen))) {
+	p = &r->next;
+	continue;
+      }
+      retireResponse(p, r);
+      __atomic_store_n(&cacheInvalidations, cacheInvalidations + 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Free the retired responses nobody can be using any more: every
+// worker has waited, or woken up to a later cacheEpoch, since they
+// were unlinked, and no queued response counts them.
+void reclaimResponses(void) {
+  struct cached_response **p, *r;
+  uint64_t seen, oldest = UINT64_MAX;
+  int i;
+
+  pthread_mutex_lock(&cacheLock);
+  for (i = 0; cacheRetired != NULL && i < numWorkersStarted; i++) {
+    seen = __atomic_load_n(&cacheReaders[i].epoch, __ATOMIC_ACQUIRE);
+    if (seen != 0 && seen < oldest) oldest = seen;
+  }
+  for (p = &cacheRetired; (r = *p) != NULL; ) {
+    if (r->retiredEpoch > oldest || __atomic_load_n(&r->refs, __ATOMIC_ACQUIRE) > 0) {
+      p = &r->retired;
+      continue;
+    }
+    *p = r->retired;
+    __atomic_store_n(&cacheBytes, cacheBytes - r->mapLen, __ATOMIC_RELAXED);
+    cacheRetiredBytes -= r->mapLen;
+    __atomic_store_n(&cacheRoom, cacheRoom + 1, __ATOMIC_RELEASE);
+    munmap(r->t.buf[0], r->mapLen);
+    free(r);
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+void startCacheThread(void) {
+  pthread_t thread;
+
+  if (-1 == (inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC))) {
+    perror("inotify_init1");
+    exit(-1);
+  }
+  if (pthread_create(&thread, NULL, cacheLoop, NULL)) {
+    perror("pthread_create");
+    exit(-1);
+  }
+}
+
+// The cache thread: apply inotify events as they come, and reclaim
+// every CACHE_RECLAIM_MS.
+void *cacheLoop(void *arg) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd = { inotifyFd, POLLIN, 0 };
+  struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+
+  while (1) {
+    if (poll(&pfd, 1, CACHE_RECLAIM_MS) > 0) {
+      pthread_mutex_lock(&cacheLock);
+      while ((n = read(inotifyFd, buf, sizeof buf)) > 0) {
+	for (p = buf; p < buf + n; p += sizeof *ev + ev->len) {
+	  ev = (struct inotify_event *) p;
+	  if (ev->mask == (IN_CREATE | IN_ISDIR)) continue; // nothing cached there yet
+	  if (ev->len == 0 || (ev->mask & IN_ISDIR)) {
+	    // the directory itself, a subdirectory, or a lost event
+	    invalidateResponses(NULL, 0);
+	  } else {
+	    invalidateResponses(ev->name, strlen(ev->name));
+	  }
+	}
+      }
+      __atomic_store_n(&cacheGeneration, cacheGeneration + 1, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&cacheLock);
+    }
+    reclaimResponses();
+  }
+  pthread_exit(NULL);
+}
+
+void printCacheStats(FILE *out) {
+  uint64_t hits, misses, sumHits = 0, sumMisses = 0;
+  int i;
+
+  for (i = 0; i < numWorkersStarted; i++) {
+    hits = __atomic_load_n(&workerStats[i].cacheHits, __ATOMIC_RELAXED);
+    misses = __atomic_load_n(&workerStats[i].cacheMisses, __ATOMIC_RELAXED);
+    fprintf(out, "cache worker %d: hits %lu misses %lu\n", i, hits, misses);
+    sumHits += hits;
+    sumMisses += misses;
+  }
+  fprintf(out, "cache total: responses %ld bytes %ld invalidations %ld evictions %ld"
+	  " hits %lu misses %lu hit rate %.1f%%\n",
+	  __atomic_load_n(&cacheEntries, __ATOMIC_RELAXED),
+	  __atomic_load_n(&cacheBytes, __ATOMIC_RELAXED),
+	  __atomic_load_n(&cacheInvalidations, __ATOMIC_RELAXED),
+	  __atomic_load_n(&cacheEvictions, __ATOMIC_RELAXED), sumHits, sumMisses,
+	  sumHits + sumMisses ? 100.0 * sumHits / (sumHits + sumMisses) : 0.0);
+  fflush(out);
+}
+
+// Zero-copy sends (-Z).
+//
+// Cached bodies of at least -Z bytes are sent with MSG_ZEROCOPY (the
+// listen socket has SO_ZEROCOPY, which accepted sockets inherit): the
+// kernel sends from the response's pages instead of copying them into
+// the socket, and reports on the socket's error queue once it is done
+// with them. Each completion covers a range of sends, which the kernel
+// numbers from 0 per socket, counting only those that sent something.
+// Until its send completes a response holds a reference, like one left
+// queued on a full socket, and the worker that next services the
+// connection reaps whatever came back. Pinning pages and taking a
+// completion cost about as much as copying a few pages, so this only
+// pays for large bodies, and on loopback never: delivering locally, the
+// kernel copies after all (reported as copied).
+
+// Send what is left of s's body, which is large enough for -Z, from
+// worker w. Returns what send does.
+ssize_t sendZeroCopy(int sock, int w, struct file_send *s, int more) {
+  struct conn *c = getConn(sock);
+  struct zerocopy_pins *p = c->pins;
+  char *body = s->t->buf[0] + s->pos; // both copies have the same body
+  size_t len = s->len - s->pos;
+  int flags = more ? MSG_MORE : 0;
+  ssize_t n;
+
+  if (p == NULL || p->count < ZEROCOPY_PINS) {
+    n = send(sock, body, len, flags | MSG_ZEROCOPY);
+    if (n > 0) {
+      if (p == NULL) {
+	p = c->pins = bufAlloc();
+	p->head = 0;
+	p->count = 0;
+      }
+      __atomic_fetch_add(&s->cached->refs, 1, __ATOMIC_RELAXED);
+      p->pinned[(p->head + p->count) % ZEROCOPY_PINS] = s->cached;
+      p->count++;
+      c->zeroCopyId++;
+      STAT_ADD(w, zeroCopySends, 1);
+      return n;
+    }
+    // ENOBUFS: completions not reaped yet have used up optmem_max
+    if (n == 0 || errno != ENOBUFS) return n;
+  }
+  STAT_ADD(w, zeroCopyFallbacks, 1);
+  return send(sock, body, len, flags);
+}
+
+// Take the completions off sock's error queue, from worker w, and
+// release the responses they were for.
+void reapZeroCopy(int sock, int w) {
+  struct conn *c = getConn(sock);
+  struct zerocopy_pins *p = c->pins;
+  struct cached_response **slot;
+  struct sock_extended_err *err;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+  char control[CMSG_SPACE(sizeof (struct sock_extended_err) + sizeof (struct sockaddr_in))];
+  uint32_t first;
+  int i;
+
+  while (1) {
+    memset(&msg, 0, sizeof msg);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    if (-1 == recvmsg(sock, &msg, MSG_ERRQUEUE)) {
+      if (errno == EINTR) continue;
+      break; // EAGAIN: nothing more has completed
+    }
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+      err = (struct sock_extended_err *) CMSG_DATA(cm);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) continue;
+      // sends ee_info to ee_data have completed
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+	STAT_ADD(w, zeroCopyCopied, err->ee_data - err->ee_info + 1);
+      }
+      first = c->zeroCopyId - p->count;
+      for (i = 0; i < p->count; i++) {
+	slot = &p->pinned[(p->head + i) % ZEROCOPY_PINS];
+	if (*slot != NULL && first + i - err->ee_info <= err->ee_data - err->ee_info) {
+	  releaseResponse(*slot);
+	  *slot = NULL;
+	}
+      }
+    }
+  }
+  while (p->count > 0 && p->pinned[p->head] == NULL) {
+    p->head = (p->head + 1) % ZEROCOPY_PINS;
+    p->count--;
+  }
+  if (p->count == 0) {
+    poolFree(p);
+    c->pins = NULL;
+  }
+}
+
+// What a closing connection still had pinned. Its completions can no
+// longer be reaped, but nothing is lost by not waiting for them: the
+// kernel holds its own references to the pages it still sends from, and
+// as no body is ever written to, its response may as well be unmapped.
+void freeZeroCopyPins(struct zerocopy_pins *p) {
+  int i;
+  for (i = 0; i < p->count; i++) {
+    if (p->pinned[(p->head + i) % ZEROCOPY_PINS] != NULL) {
+      releaseResponse(p->pinned[(p->head + i) % ZEROCOPY_PINS]);
+    }
+  }
+  poolFree(p);
+}
+
+void printZeroCopyStats(FILE *out) {
+  uint64_t sends, copied, fallbacks, sumSends = 0, sumCopied = 0, sumFallbacks = 0;
+  int i;
+
+  for (i = 0; i < numWorkersStarted; i++) {
+    sends = __atomic_load_n(&workerStats[i].zeroCopySends, __ATOMIC_RELAXED);
+    copied = __atomic_load_n(&workerStats[i].zeroCopyCopied, __ATOMIC_RELAXED);
+    fallbacks = __atomic_load_n(&workerStats[i].zeroCopyFallbacks, __ATOMIC_RELAXED);
+    fprintf(out, "zerocopy worker %d: sends %lu copied %lu fallbacks %lu\n",
+	    i, sends, copied, fallbacks);
+    sumSends += sends;
+    sumCopied += copied;
+    sumFallbacks += fallbacks;
+  }
+  fprintf(out, "zerocopy total: sends %lu copied %lu fallbacks %lu\n",
+	  sumSends, sumCopied, sumFallbacks);
+  fflush(out);
+}
+
+// Memory pools.
+//
+// Every thread that creates or serves connections owns a pool_set: a
+// slab pool of connection objects and a pool of BUF_SIZE buffers. Slabs
+// are SLAB_SIZE-aligned (a huge page when -H is given), and each starts
+// with a header naming its pool, so poolFree finds an object's home pool
+// by masking the pointer. Allocation and same-thread frees are a pop or
+// push on the owner's private free list; frees from other threads go to
+// a lock-free remote list that the owner takes over wholesale when its
+// private list runs dry.
+
+struct slab_header {
+  struct pool *pool;
+};
+
+struct free_obj {
+  struct free_obj *next;
+};
+
+// Map one SLAB_SIZE-aligned slab.
+static char *slabMap(void) {
+  char *p, *aligned;
+
+  if (useHugePages) {
+    p = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return p;
+  }
+  // over-allocate and trim to get the alignment
+  p = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap slab");
+    exit(-1);
+  }
+  aligned = (char *)(((uintptr_t) p + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+  if (aligned > p) munmap(p, aligned - p);
+  munmap(aligned + SLAB_SIZE, p + SLAB_SIZE - aligned);
+  if (useHugePages) madvise(aligned, SLAB_SIZE, MADV_HUGEPAGE);
+  return aligned;
+}
+
+static void poolGrow(struct pool *pool) {
+  char *slab = slabMap();
+  char *obj;
+  struct free_obj *f;
+
+  ((struct slab_header *) slab)->pool = pool;
+  // objects start at the first objSize boundary past the header
+  for (obj = slab + pool->objSize; obj + pool->objSize <= slab + SLAB_SIZE;
+       obj += pool->objSize) {
+    f = (struct free_obj *) obj;
+    f->next = pool->freeList;
+    pool->freeList = f;
+    pool->capacity++;
+  }
+  pool->slabs++;
+}
+
+void *poolAlloc(struct pool *pool) {
+  struct free_obj *f = pool->freeList;
+  int n;
+
+  if (f == NULL) {
+    f = __atomic_exchange_n(&pool->remoteFree, NULL, __ATOMIC_ACQUIRE);
+    if (f != NULL) {
+      for (n = 0, pool->freeList = f; f != NULL; f = f->next) n++;
+      pool->inUse -= n;
+      f = pool->freeList;
+    } else {
+      poolGrow(pool);
+      f = pool->freeList;
+    }
+  }
+  pool->freeList = f->next;
+  pool->inUse++;
+  return f;
+}
+
+void poolFree(void *obj) {
+  struct slab_header *h = (struct slab_header *)((uintptr_t) obj & ~(uintptr_t)(SLAB_SIZE - 1));
+  struct pool *pool = h->pool;
+  struct free_obj *f = obj;
+
+  if (pool->owner == localPools) {
+    f->next = pool->freeList;
+    pool->freeList = f;
+    pool->inUse--;
+  } else {
+    f->next = __atomic_load_n(&pool->remoteFree, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pool->remoteFree, &f->next, f, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+// Give the calling thread its pools; id identifies them in the report.
+void initThreadPools(int id) {
+  struct pool_set *ps = calloc(1, sizeof (struct pool_set));
+  int i;
+
+  if (ps == NULL) {
+    perror("calloc pool_set");
+    exit(-1);
+  }
+  ps->id = id;
+  ps->conns.objSize = sizeof (struct conn);
+  ps->conns.owner = ps;
+  ps->bufs.objSize = BUF_SIZE;
+  ps->bufs.owner = ps;
+  localPools = ps;
+  i = __atomic_fetch_add(&numPoolSets, 1, __ATOMIC_RELAXED);
+  poolSets[i] = ps;
+}
+
+void *bufAlloc(void) {
+  return poolAlloc(&localPools->bufs);
+}
+
+void printPoolStats(FILE *out) {
+  struct pool_set *ps;
+  int i, n = __atomic_load_n(&numPoolSets, __ATOMIC_ACQUIRE);
+
+  for (i = 0; i < n; i++) {
+    ps = poolSets[i];
+    if (ps->id < 0) {
+      fprintf(out, "pools acceptor: ");
+    } else {
+      fprintf(out, "pools worker %d: ", ps->id);
+    }
+    fprintf(out, "conns %ld/%ld (%d slabs), bufs %ld/%ld (%d slabs)\n",
+	   __atomic_load_n(&ps->conns.inUse, __ATOMIC_RELAXED), ps->conns.capacity,
+	   ps->conns.slabs,
+	   __atomic_load_n(&ps->bufs.inUse, __ATOMIC_RELAXED), ps->bufs.capacity,
+	   ps->bufs.slabs);
+  }
+  fflush(out);
+}
+
+void *statsLoop(void *arg) {
+  int secs = (int)(unsigned long) arg;
+  while (1) {
+    sleep(secs);
+    printReport(stdout);
+  }
+  pthread_exit(NULL);
+}
+
 
 void setNonBlocking(int fd) {
   int flags;
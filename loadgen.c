@@ -0,0 +1,483 @@
+// compile with
+// gcc -O2 loadgen.c -lpthread -Wall -o loadgen
+//
+// A small keep-alive HTTP load generator, so the servers in this directory
+// can be benchmarked without weighttp. It sends EXPECTED_HTTP_REQUEST byte
+// for byte (the same request the servers are built to expect), keeps
+// -p requests in flight on each of -c connections spread over -t threads,
+// and reports requests/second and latency percentiles after -d seconds.
+// With -k n each connection is closed after n responses and replaced by
+// a new one (reset instead of closed with -R), to load the servers'
+// accept and close paths rather than just their request path. -u path
+// asks for path instead of /, e.g. a file under epollbug's -D root.
+//
+// To match a server's NUM_CLIENTS, use "make bench SERVER=<name>", which
+// reads NUM_CLIENTS from <name>.c and passes it as -c.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// data types
+
+// Latency histogram: values are in microseconds, bucketed log-linearly
+// (HIST_SUB_BUCKETS linear buckets per power of two).
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+struct connection {
+  int fd;
+  char *inbuf;
+  int inlen;
+  int outstanding;      // requests sent but not yet answered
+  int sendOffset;       // bytes of the current request batch already sent
+  int sendLen;          // bytes in the current request batch
+  int waitingForOut;    // a short write is parked until EPOLLOUT
+  int bodyRemaining;    // body bytes still to skip for the current response
+  uint64_t *sentAt;     // send timestamps, FIFO of size pipeline
+  int sentHead;
+  int sentTail;
+  int sent;             // requests sent on this connection (for -k)
+};
+
+struct thread_info {
+  int numConnections;
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t reconnects;
+  struct histogram hist;
+};
+
+// prototypes
+void *clientLoop(void *);
+int connectTo(void);
+void sendRequests(struct connection *, int, int);
+void reconnect(struct connection *, int);
+int processInput(struct connection *, struct histogram *);
+void histRecord(struct histogram *, uint64_t);
+void histMerge(struct histogram *, struct histogram *);
+uint64_t histPercentile(struct histogram *, double);
+uint64_t nowMicros(void);
+void setNonBlocking(int);
+
+// constants
+#define PORT_NUM (8080)
+#define MAX_EVENTS 500
+#define NUM_CLIENTS 1000
+#define MAX_THREADS 256
+#define INBUF_SIZE 65536
+
+// Keep this identical to EXPECTED_HTTP_REQUEST in the servers.
+char EXPECTED_HTTP_REQUEST[] =
+  "GET / HTTP/1.1\r\nHost: 10.12.0.1:8080\r\n"
+  "User-Agent: weighttp/0.3\r\nConnection: keep-alive\r\n\r\n";
+int EXPECTED_RECV_LEN;
+
+// global variables
+char *request = EXPECTED_HTTP_REQUEST; // or the same for -u path
+char *requestBatch;     // pipeline copies of request
+int pipelineDepth = 1;
+int durationSecs = 10;
+int requestsPerConnection;  // -k: 0 keeps every connection open
+int resetOnClose;           // -R: end connections with an RST
+struct sockaddr_in serverAddr;
+volatile int running = 1;
+struct thread_info threads[MAX_THREADS];
+
+int main(int argc, char *argv[]) {
+  int opt;
+  int numConnections = NUM_CLIENTS;
+  int numThreads = 1;
+  char *host = "127.0.0.1";
+  int port = PORT_NUM;
+  pthread_t tids[MAX_THREADS];
+  struct histogram total;
+  uint64_t requests = 0, errors = 0, reconnects = 0;
+  uint64_t start, elapsed;
+  int i;
+
+  while ((opt = getopt(argc, argv, "c:t:p:d:h:k:P:Ru:")) != -1) {
+    switch (opt) {
+    case 'c': numConnections = atoi(optarg); break;
+    case 't': numThreads = atoi(optarg); break;
+    case 'p': pipelineDepth = atoi(optarg); break;
+    case 'd': durationSecs = atoi(optarg); break;
+    case 'h': host = optarg; break;
+    case 'P': port = atoi(optarg); break;
+    case 'k': requestsPerConnection = atoi(optarg); break;
+    case 'R': resetOnClose = 1; break;
+    case 'u':
+      // the request line's target, the rest as before
+      if (optarg[0] != '/' ||
+	  asprintf(&request, "GET %s%s", optarg, EXPECTED_HTTP_REQUEST + strlen("GET /")) < 0) {
+	printf("error: bad path %s\n", optarg);
+	return -1;
+      }
+      break;
+    default:
+      printf("usage: %s [-c connections] [-t threads] [-p pipeline] "
+	     "[-d seconds] [-h host] [-P port] [-k requests/connection [-R]] [-u path]\n",
+	     argv[0]);
+      return -1;
+    }
+  }
+  if (numThreads < 1 || numThreads > MAX_THREADS || numConnections < numThreads ||
+      pipelineDepth < 1 || durationSecs < 1 || requestsPerConnection < 0) {
+    printf("error: need 1 <= threads <= %d, connections >= threads, "
+	   "pipeline >= 1 and duration >= 1\n", MAX_THREADS);
+    return -1;
+  }
+
+  EXPECTED_RECV_LEN = strlen(request);
+  requestBatch = malloc(EXPECTED_RECV_LEN * pipelineDepth);
+  for (i = 0; i < pipelineDepth; i++) {
+    memcpy(requestBatch + i * EXPECTED_RECV_LEN, request, EXPECTED_RECV_LEN);
+  }
+
+  memset(&serverAddr, 0, sizeof serverAddr);
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &serverAddr.sin_addr) != 1) {
+    printf("error: bad address %s\n", host);
+    return -1;
+  }
+
+  printf("%d connections, %d threads, pipeline %d, %d seconds\n",
+	 numConnections, numThreads, pipelineDepth, durationSecs);
+  if (requestsPerConnection > 0) {
+    printf("reconnecting after %d requests%s\n", requestsPerConnection,
+	   resetOnClose ? ", with a reset" : "");
+  }
+
+  start = nowMicros();
+  for (i = 0; i < numThreads; i++) {
+    threads[i].numConnections = numConnections / numThreads +
+      (i < numConnections % numThreads ? 1 : 0);
+    if (pthread_create(&tids[i], NULL, clientLoop, &threads[i])) {
+      perror("pthread_create");
+      exit(-1);
+    }
+  }
+  sleep(durationSecs);
+  running = 0;
+
+  memset(&total, 0, sizeof total);
+  for (i = 0; i < numThreads; i++) {
+    pthread_join(tids[i], NULL);
+    requests += threads[i].requests;
+    errors += threads[i].errors;
+    reconnects += threads[i].reconnects;
+    histMerge(&total, &threads[i].hist);
+  }
+  elapsed = nowMicros() - start;
+
+  printf("requests: %lu  errors: %lu  req/s: %.0f\n",
+	 requests, errors, requests * 1e6 / elapsed);
+  if (requestsPerConnection > 0) {
+    printf("reconnects: %lu  conn/s: %.0f\n", reconnects, reconnects * 1e6 / elapsed);
+  }
+  printf("latency (us): p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+	 histPercentile(&total, 50), histPercentile(&total, 90),
+	 histPercentile(&total, 99), histPercentile(&total, 99.9), total.max);
+  return 0;
+}
+
+void *clientLoop(void *arg) {
+  struct thread_info *ti = arg;
+  struct connection *conns;
+  struct epoll_event event;
+  struct epoll_event *events;
+  int epfd;
+  int n, i;
+
+  if (-1 == (epfd = epoll_create1(0))) {
+    perror("epoll_create1");
+    exit(-1);
+  }
+  events = calloc(MAX_EVENTS, sizeof (struct epoll_event));
+  conns = calloc(ti->numConnections, sizeof (struct connection));
+
+  for (i = 0; i < ti->numConnections; i++) {
+    struct connection *c = &conns[i];
+    c->fd = connectTo();
+    c->inbuf = malloc(INBUF_SIZE);
+    c->sentAt = calloc(pipelineDepth, sizeof (uint64_t));
+    event.data.ptr = c;
+    event.events = EPOLLIN;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &event)) {
+      perror("epoll_ctl");
+      exit(-1);
+    }
+    sendRequests(c, pipelineDepth, epfd);
+  }
+
+  while (running) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    for (i = 0; i < n; i++) {
+      struct connection *c = events[i].data.ptr;
+      int answered;
+
+      if (c->fd == -1) continue;
+      if (events[i].events & EPOLLOUT) {
+	sendRequests(c, 0, epfd);
+      }
+      if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) continue;
+      answered = processInput(c, &ti->hist);
+      if (answered < 0) {
+	ti->errors++;
+	close(c->fd);
+	c->fd = -1;
+	continue;
+      }
+      ti->requests += answered;
+      if (requestsPerConnection > 0 && c->outstanding == 0 &&
+	  c->sent >= requestsPerConnection && running) {
+	reconnect(c, epfd);
+	ti->reconnects++;
+	continue;
+      }
+      if (answered > 0 && running) {
+	sendRequests(c, answered, epfd);
+      }
+    }
+  }
+
+  for (i = 0; i < ti->numConnections; i++) {
+    if (conns[i].fd != -1) close(conns[i].fd);
+  }
+  close(epfd);
+  pthread_exit(NULL);
+}
+
+int connectTo(void) {
+  int fd;
+  int optval = 1;
+
+  if (-1 == (fd = socket(PF_INET, SOCK_STREAM, 0))) {
+    perror("socket");
+    exit(-1);
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof optval);
+  if (connect(fd, (struct sockaddr *) &serverAddr, sizeof serverAddr)) {
+    perror("connect");
+    exit(-1);
+  }
+  setNonBlocking(fd);
+  return fd;
+}
+
+// -k: replace c, which has no requests outstanding, with a fresh
+// connection and start it off like the first one.
+void reconnect(struct connection *c, int epfd) {
+  struct linger lg = { 1, 0 };
+  struct epoll_event event;
+
+  if (resetOnClose) setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof lg);
+  close(c->fd);
+  c->fd = connectTo();
+  c->inlen = 0;
+  c->outstanding = 0;
+  c->sendOffset = 0;
+  c->sendLen = 0;
+  c->waitingForOut = 0;
+  c->bodyRemaining = 0;
+  c->sentHead = 0;
+  c->sentTail = 0;
+  c->sent = 0;
+  event.data.ptr = c;
+  event.events = EPOLLIN;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &event)) {
+    perror("epoll_ctl");
+    exit(-1);
+  }
+  sendRequests(c, pipelineDepth, epfd);
+}
+
+// Queue count more requests on c (count == 0 just flushes what is left
+// after a short write) and send as much as the socket takes. A short
+// write parks the rest until EPOLLOUT. Since at most pipelineDepth
+// requests are ever outstanding, the unsent bytes always fit in
+// requestBatch, and because every copy is identical the batch can be sent
+// from any request-aligned offset.
+void sendRequests(struct connection *c, int count, int epfd) {
+  struct epoll_event event;
+  uint64_t now;
+  ssize_t m;
+  int i;
+
+  if (count > 0 && requestsPerConnection > 0) {
+    // with -k, never ask for more than the connection has left.
+    if (count > requestsPerConnection - c->sent) count = requestsPerConnection - c->sent;
+    if (count == 0) return;
+    c->sent += count;
+  }
+  if (count > 0) {
+    now = nowMicros();
+    for (i = 0; i < count; i++) {
+      c->sentAt[c->sentTail] = now;
+      c->sentTail = (c->sentTail + 1) % pipelineDepth;
+    }
+    c->outstanding += count;
+    // rebase to the request a short write stopped in, so that the
+    // requests left to send (never more than the pipeline) fit in
+    // requestBatch.
+    c->sendLen -= c->sendOffset - c->sendOffset % EXPECTED_RECV_LEN;
+    c->sendOffset %= EXPECTED_RECV_LEN;
+    c->sendLen += count * EXPECTED_RECV_LEN;
+    if (c->waitingForOut) return;
+  }
+
+  while (c->sendOffset < c->sendLen) {
+    m = send(c->fd, requestBatch + c->sendOffset, c->sendLen - c->sendOffset,
+	     MSG_NOSIGNAL);
+    if (m == -1) {
+      if (errno != EAGAIN) return;  // the recv side reports the error
+      if (!c->waitingForOut) {
+	c->waitingForOut = 1;
+	event.data.ptr = c;
+	event.events = EPOLLIN | EPOLLOUT;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &event);
+      }
+      return;
+    }
+    c->sendOffset += m;
+  }
+  c->sendOffset = 0;
+  c->sendLen = 0;
+  if (c->waitingForOut) {
+    c->waitingForOut = 0;
+    event.data.ptr = c;
+    event.events = EPOLLIN;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &event);
+  }
+}
+
+// Read whatever is available and return the number of complete responses
+// received, or -1 if the connection failed or the server closed it.
+int processInput(struct connection *c, struct histogram *hist) {
+  int answered = 0;
+  uint64_t now;
+  ssize_t m;
+
+  while (1) {
+    m = recv(c->fd, c->inbuf + c->inlen, INBUF_SIZE - c->inlen, 0);
+    if (m == 0) return -1;
+    if (m == -1) {
+      if (errno == EAGAIN) break;
+      return -1;
+    }
+    c->inlen += m;
+
+    // Parse as many complete responses as the buffer holds.
+    char *p = c->inbuf;
+    char *end = c->inbuf + c->inlen;
+    while (p < end) {
+      if (c->bodyRemaining > 0) {
+	int skip = end - p < c->bodyRemaining ? end - p : c->bodyRemaining;
+	p += skip;
+	c->bodyRemaining -= skip;
+	if (c->bodyRemaining > 0) break;
+      } else {
+	char *hdrEnd = memmem(p, end - p, "\r\n\r\n", 4);
+	char *cl;
+	if (hdrEnd == NULL) break;
+	cl = memmem(p, hdrEnd - p, "Content-Length:", 15);
+	c->bodyRemaining = cl ? atoi(cl + 15) : 0;
+	p = hdrEnd + 4;
+	if (c->bodyRemaining > 0) continue;
+      }
+      // A response is complete.
+      now = nowMicros();
+      histRecord(hist, now - c->sentAt[c->sentHead]);
+      c->sentHead = (c->sentHead + 1) % pipelineDepth;
+      c->outstanding--;
+      answered++;
+    }
+    c->inlen = end - p;
+    memmove(c->inbuf, p, c->inlen);
+    if (c->inlen == INBUF_SIZE) return -1; // header larger than the buffer
+  }
+  return answered;
+}
+
+static int histIndex(uint64_t v) {
+  int msb;
+  if (v < HIST_SUB_BUCKETS) return v;
+  msb = 63 - __builtin_clzll(v);
+  return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+    ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+// Smallest value that lands in bucket i.
+static uint64_t histValue(int i) {
+  int major = i / HIST_SUB_BUCKETS;
+  int minor = i % HIST_SUB_BUCKETS;
+  if (major == 0) return minor;
+  return (uint64_t)(HIST_SUB_BUCKETS + minor) << (major - 1);
+}
+
+void histRecord(struct histogram *h, uint64_t v) {
+  h->counts[histIndex(v)]++;
+  h->total++;
+  if (v > h->max) h->max = v;
+}
+
+void histMerge(struct histogram *dst, struct histogram *src) {
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t histPercentile(struct histogram *h, double pct) {
+  uint64_t target = (uint64_t)(h->total * pct / 100.0);
+  uint64_t seen = 0;
+  int i;
+  if (h->total == 0) return 0;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > target) return histValue(i);
+  }
+  return h->max;
+}
+
+uint64_t nowMicros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void setNonBlocking(int fd) {
+  int flags;
+  if (-1 == (flags = fcntl(fd, F_GETFL, 0))) {
+    perror("Getting NONBLOCKING failed.\n");
+    exit(-1);
+  }
+  if ( fcntl(fd, F_SETFL, flags | O_NONBLOCK ) < 0 ) {
+    perror("Setting NONBLOCKING failed.\n");
+    exit(-1);
+  }
+  return;
+}